@@ -0,0 +1,456 @@
+// Benchmarks for the inpainting and guided filter stages.
+//
+// Synthetic inputs are generated from a fixed seed, so runs are
+// repeatable. Frame-sized benchmarks report throughput in megapixels/s
+// ("MP/s"). The demo benchmarks read demo/images and are skipped if the
+// images cannot be loaded.
+#include "gdfmm/gdfmm.h"
+#include "gdfmm/pipeline.h"
+#include "gdfmm_internals.h"
+#include "integral_window.h"
+#include "narrow_band.h"
+#include "speed_map.h"
+#include "window_kernel.h"
+#include "window_statistics.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <benchmark/benchmark.h>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifndef GDFMM_DEMO_DIR
+#define GDFMM_DEMO_DIR "demo/images"
+#endif
+
+using namespace gdfmm;
+
+namespace {
+
+const int kWidths[] = {640, 1280, 1920};
+const int kHeights[] = {480, 720, 1080};
+
+/* A frame of four colored regions at different depth planes, with noise,
+ * and disc-shaped holes until `holePercent` of the depth is missing. */
+struct Scene {
+  cv::Mat depth, rgb;
+
+  Scene(int cols, int rows, int holePercent) {
+    std::mt19937 random(1);
+    std::uniform_int_distribution<int> noise(0, 9);
+    rgb.create(rows, cols, CV_8UC3);
+    depth.create(rows, cols, CV_16U);
+    for (int y=0; y<rows; y++) {
+      for (int x=0; x<cols; x++) {
+        int region = (x > cols / 2) + 2 * (y > rows / 2);
+        for (int c=0; c<3; c++) {
+          rgb.ptr<uint8_t>(y)[3 * x + c] =
+              static_cast<uint8_t>(40 * region + 20 * c + noise(random));
+        }
+        depth.at<uint16_t>(y, x) =
+            static_cast<uint16_t>(1000 + 200 * region + x / 4 + y / 8);
+      }
+    }
+
+    std::uniform_int_distribution<int> px(0, cols - 1), py(0, rows - 1),
+        pr(2, 12);
+    long missing = 0, target = static_cast<long>(rows) * cols * holePercent / 100;
+    while (missing < target) {
+      int cx = px(random), cy = py(random), r = pr(random);
+      for (int y=std::max(0, cy - r); y<std::min(rows, cy + r + 1); y++) {
+        for (int x=std::max(0, cx - r); x<std::min(cols, cx + r + 1); x++) {
+          uint16_t &d = depth.at<uint16_t>(y, x);
+          if ((x - cx) * (x - cx) + (y - cy) * (y - cy) <= r * r && d != 0) {
+            d = 0;
+            missing++;
+          }
+        }
+      }
+    }
+  }
+};
+
+const Scene &SceneFor(int resolution, int holePercent) {
+  // one cached scene per argument pair
+  static std::vector<std::unique_ptr<Scene> > scenes(3 * 101);
+  std::unique_ptr<Scene> &scene = scenes[resolution * 101 + holePercent];
+  if (!scene) {
+    scene.reset(new Scene(kWidths[resolution], kHeights[resolution],
+                          holePercent));
+  }
+  return *scene;
+}
+
+void SetPixelRate(benchmark::State &state, const cv::Mat &image) {
+  state.counters["MP/s"] = benchmark::Counter(
+      static_cast<double>(image.total()) * state.iterations() / 1e6,
+      benchmark::Counter::kIsRate);
+}
+
+// Resolution (0: VGA, 1: 720p, 2: 1080p) times hole density in percent.
+void FrameArgs(benchmark::internal::Benchmark *b) {
+  for (int resolution=0; resolution<3; resolution++) {
+    for (int holes : {5, 20}) {
+      b->Args({resolution, holes});
+    }
+  }
+  b->Unit(benchmark::kMillisecond);
+}
+
+// Pixels of `depth` that are zero, in row order.
+std::vector<cv::Point> MissingPixels(const cv::Mat &depth) {
+  std::vector<cv::Point> missing;
+  for (int y=0; y<depth.rows; y++) {
+    for (int x=0; x<depth.cols; x++) {
+      if (depth.at<float>(y, x) == 0) {
+        missing.push_back(cv::Point(x, y));
+      }
+    }
+  }
+  return missing;
+}
+
+// --- micro-benchmarks ---
+
+// Spatial and color ExpCache lookups of one 11x11 window.
+void BM_ExpCache(benchmark::State &state) {
+  GDFMM gdfmm(2, 10, 1, 11);
+  for (auto _ : state) {
+    float sum = 0;
+    for (int dy=-5; dy<=5; dy++) {
+      for (int dx=-5; dx<=5; dx++) {
+        sum += GDFMMInternals::DistanceWeight(gdfmm, dx) *
+               GDFMMInternals::DistanceWeight(gdfmm, dy) *
+               GDFMMInternals::ColorWeight(gdfmm, 7 * dx + dy);
+      }
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * 3 * 121);
+}
+BENCHMARK(BM_ExpCache);
+
+// Window sums of the guided filter over CV_64F integral images, at every
+// pixel of a VGA frame; the 3-channel sums come from the reference.
+void BM_SumAt(benchmark::State &state, bool threeChannels) {
+  const Scene &scene = SceneFor(0, 0);
+  const int windowSize = static_cast<int>(state.range(0));
+  cv::Mat image, integralImage;
+  if (threeChannels) {
+    scene.rgb.convertTo(image, CV_32FC3);
+  }
+  else {
+    scene.depth.convertTo(image, CV_32F);
+  }
+  cv::integral(image, integralImage, CV_64F);
+  for (auto _ : state) {
+    for (int y=0; y<image.rows; y++) {
+      for (int x=0; x<image.cols; x++) {
+        int count;
+        if (threeChannels) {
+          benchmark::DoNotOptimize(
+              sumAt3(integralImage, x, y, windowSize, &count));
+        }
+        else {
+          benchmark::DoNotOptimize(
+              sumAt(integralImage, x, y, windowSize, &count));
+        }
+      }
+    }
+  }
+  SetPixelRate(state, image);
+}
+BENCHMARK_CAPTURE(BM_SumAt, sumAt, false)
+    ->Arg(5)->Arg(11)->Arg(21)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_SumAt, sumAt3, true)
+    ->Arg(5)->Arg(11)->Arg(21)->Unit(benchmark::kMillisecond);
+
+// PredictDepth at the missing pixels of a VGA frame with 20% holes, for
+// window sizes with a fixed-length kernel (5, 11) and without (9).
+void BM_PredictDepth(benchmark::State &state) {
+  const Scene &scene = SceneFor(0, 20);
+  GDFMM gdfmm(2, 10, 1, static_cast<unsigned int>(state.range(0)));
+  cv::Mat depth;
+  scene.depth.convertTo(depth, CV_32F);
+  const std::vector<cv::Point> missing = MissingPixels(depth);
+  size_t i = 0;
+  for (auto _ : state) {
+    const cv::Point &p = missing[i++ % missing.size()];
+    benchmark::DoNotOptimize(
+        GDFMMInternals::PredictDepth(gdfmm, depth, scene.rgb, p.x, p.y));
+  }
+}
+BENCHMARK(BM_PredictDepth)->Arg(5)->Arg(9)->Arg(11);
+
+// Window-scan PredictDepth2 of InPaint2, at the same pixels.
+void BM_PredictDepth2(benchmark::State &state) {
+  const Scene &scene = SceneFor(0, 20);
+  GDFMM gdfmm(2, 10, 1, static_cast<unsigned int>(state.range(0)));
+  cv::Mat depth;
+  scene.depth.convertTo(depth, CV_32F);
+  const std::vector<cv::Point> missing = MissingPixels(depth);
+  size_t i = 0;
+  for (auto _ : state) {
+    const cv::Point &p = missing[i++ % missing.size()];
+    benchmark::DoNotOptimize(GDFMMInternals::PredictDepth2(
+        gdfmm, depth, scene.rgb, p.x, p.y, 0, 1, 0.05f));
+  }
+}
+BENCHMARK(BM_PredictDepth2)->Arg(5)->Arg(11)->Arg(21);
+
+// One window row of PredictDepth, with a third of the taps missing.
+void BM_AccumulateRow(benchmark::State &state, AccumulateRowFn accumulate) {
+  const int length = static_cast<int>(state.range(0));
+  std::vector<float> depth(length), kernel(length);
+  std::vector<uint8_t> rgb(3 * length);
+  std::vector<float> table(511);
+  for (int i=0; i<511; i++) {
+    table[i] = std::exp(-0.5f * (i - 255) * (i - 255) / 100.0f);
+  }
+  for (int j=0; j<length; j++) {
+    depth[j] = j % 3 ? 1000.0f + j : 0.0f;
+    kernel[j] = 1.0f / (1 + j);
+    for (int c=0; c<3; c++) {
+      rgb[3 * j + c] = static_cast<uint8_t>(100 + 7 * j + c);
+    }
+  }
+  const uint8_t center[3] = {120, 121, 122};
+  for (auto _ : state) {
+    WindowSums sums = {};
+    accumulate(&depth[0], &rgb[0], &kernel[0], center, &table[255], length,
+               &sums);
+    benchmark::DoNotOptimize(sums);
+  }
+  state.SetItemsProcessed(state.iterations() * length);
+}
+BENCHMARK_CAPTURE(BM_AccumulateRow, scalar, AccumulateRowScalar)
+    ->Arg(5)->Arg(7)->Arg(11);
+#ifdef GDFMM_HAVE_AVX2
+BENCHMARK_CAPTURE(BM_AccumulateRow, avx2, AccumulateRowAVX2)
+    ->Arg(5)->Arg(7)->Arg(11);
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+BENCHMARK_CAPTURE(BM_AccumulateRow, neon, AccumulateRowNEON)
+    ->Arg(5)->Arg(7)->Arg(11);
+#endif
+
+// Constant-time PredictDepth2 of the incremental InPaint2 mode.
+void BM_WindowStatisticsPredict(benchmark::State &state) {
+  const Scene &scene = SceneFor(0, 20);
+  cv::Mat depth;
+  scene.depth.convertTo(depth, CV_32F);
+  WindowStatistics statistics;
+  statistics.Init(depth, scene.rgb, 11);
+  const std::vector<cv::Point> missing = MissingPixels(depth);
+  size_t i = 0;
+  for (auto _ : state) {
+    const cv::Point &p = missing[i++ % missing.size()];
+    benchmark::DoNotOptimize(statistics.Predict(scene.rgb, p.x, p.y, 0, 1));
+  }
+}
+BENCHMARK(BM_WindowStatisticsPredict);
+
+// Narrow-band push/pop with speeds in [-1, 0) and occasional waiting pixels.
+void ResetBand(HeapBand *band) { band->Clear(); }
+void ResetBand(BucketBand *band) { band->Reset(-2, 0, 256); }
+
+template <class Band>
+void BM_NarrowBand(benchmark::State &state) {
+  const int pushes = static_cast<int>(state.range(0));
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> speed(-1.0f, 0.0f);
+  std::vector<float> keys(pushes);
+  for (float &key : keys) {
+    key = speed(random);
+  }
+  Band band;
+  for (auto _ : state) {
+    ResetBand(&band);
+    int next = 0;
+    band.emplace(0, 0);
+    while (band.size() > 0) {
+      float key = BandKey(band.top());
+      band.pop();
+      // every popped entry pushes up to two more, every 16th one waited
+      for (int k=0; k<2 && next < pushes; k++, next++) {
+        band.emplace(next % 16 ? keys[next] : key - 1, next);
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * pushes);
+}
+BENCHMARK_TEMPLATE(BM_NarrowBand, HeapBand)->Arg(1 << 16)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_NarrowBand, BucketBand)->Arg(1 << 16)->Arg(1 << 20);
+
+// Fused Sobel and speed transform of the gradient pre-pass.
+void BM_SpeedMap(benchmark::State &state) {
+  const Scene &scene = SceneFor(static_cast<int>(state.range(0)), 5);
+  cv::Mat blurred, speed;
+  cv::GaussianBlur(scene.rgb, blurred, cv::Size(0, 0), 1, 1);
+  for (auto _ : state) {
+    ComputeSpeedMap(blurred, &speed);
+  }
+  SetPixelRate(state, blurred);
+}
+BENCHMARK(BM_SpeedMap)->DenseRange(0, 2)->Unit(benchmark::kMillisecond);
+
+// --- end-to-end ---
+
+void BM_InPaint(benchmark::State &state, GDFMM::QueuePolicy policy) {
+  const Scene &scene = SceneFor(static_cast<int>(state.range(0)),
+                                static_cast<int>(state.range(1)));
+  GDFMM gdfmm(2, 10, 1, 11);
+  gdfmm.SetQueuePolicy(policy);
+  gdfmm.SetOutputDepth(-1);
+  Workspace workspace;
+  cv::Mat output;
+  for (auto _ : state) {
+    gdfmm.InPaint(scene.depth, scene.rgb, &output, &workspace);
+  }
+  SetPixelRate(state, scene.depth);
+}
+BENCHMARK_CAPTURE(BM_InPaint, heap, GDFMM::kHeapQueue)->Apply(FrameArgs);
+BENCHMARK_CAPTURE(BM_InPaint, bucket, GDFMM::kBucketQueue)->Apply(FrameArgs);
+
+// Depth gradient term from the cached gradient field.
+void BM_InPaintGradient(benchmark::State &state) {
+  const Scene &scene = SceneFor(static_cast<int>(state.range(0)),
+                                static_cast<int>(state.range(1)));
+  GDFMM gdfmm(2, 10, 1, 11);
+  gdfmm.SetDepthGradient(true);
+  gdfmm.SetOutputDepth(-1);
+  Workspace workspace;
+  cv::Mat output;
+  for (auto _ : state) {
+    gdfmm.InPaint(scene.depth, scene.rgb, &output, &workspace);
+  }
+  SetPixelRate(state, scene.depth);
+}
+BENCHMARK(BM_InPaintGradient)->Apply(FrameArgs);
+
+// Enhance of a stream of frames, serially or with overlapped stages.
+void BM_EnhanceStream(benchmark::State &state, bool pipelined) {
+  const Scene &scene = SceneFor(static_cast<int>(state.range(0)),
+                                static_cast<int>(state.range(1)));
+  GDFMM gdfmm(2, 10, 1, 11);
+  gdfmm.SetOutputDepth(-1);
+  const int kFrames = 8;
+  if (pipelined) {
+    Pipeline pipeline(gdfmm, 9, 0.01f);
+    auto ignore = [] (const cv::Mat &, std::exception_ptr) {};
+    for (auto _ : state) {
+      for (int i=0; i<kFrames; i++) {
+        pipeline.Submit(scene.depth, scene.rgb, ignore);
+      }
+      pipeline.Flush();
+    }
+  }
+  else {
+    Workspace workspace;
+    cv::Mat output;
+    for (auto _ : state) {
+      for (int i=0; i<kFrames; i++) {
+        gdfmm.Enhance(scene.depth, scene.rgb, 9, 0.01f, &output, &workspace);
+      }
+    }
+  }
+  state.counters["frames/s"] = benchmark::Counter(
+      static_cast<double>(kFrames) * state.iterations(),
+      benchmark::Counter::kIsRate);
+}
+BENCHMARK_CAPTURE(BM_EnhanceStream, serial, false)->Apply(FrameArgs);
+BENCHMARK_CAPTURE(BM_EnhanceStream, pipeline, true)->Apply(FrameArgs);
+
+void BM_InPaint2(benchmark::State &state, bool incremental) {
+  const Scene &scene = SceneFor(static_cast<int>(state.range(0)),
+                                static_cast<int>(state.range(1)));
+  GDFMM gdfmm(2, 10, 1, 11);
+  gdfmm.SetIncrementalRegression(incremental);
+  gdfmm.SetOutputDepth(-1);
+  Workspace workspace;
+  cv::Mat output;
+  for (auto _ : state) {
+    gdfmm.InPaint2(scene.depth, scene.rgb, 0, 1, 0.05f, &output, &workspace);
+  }
+  SetPixelRate(state, scene.depth);
+}
+BENCHMARK_CAPTURE(BM_InPaint2, window, false)->Apply(FrameArgs);
+BENCHMARK_CAPTURE(BM_InPaint2, incremental, true)->Apply(FrameArgs);
+
+// Resolution times reference channels.
+void BM_GuidedFilter(benchmark::State &state,
+                     GuidedFilterOptions::Engine engine,
+                     int subsample) {
+  const Scene &scene = SceneFor(static_cast<int>(state.range(0)), 0);
+  cv::Mat object, reference;
+  scene.depth.convertTo(object, CV_32F);
+  if (state.range(1) == 1) {
+    cv::cvtColor(scene.rgb, reference, cv::COLOR_BGR2GRAY);
+  }
+  else {
+    reference = scene.rgb;
+  }
+  Workspace workspace;
+  GuidedFilterOptions options;
+  options.engine = engine;
+  options.subsample = subsample;
+  options.workspace = &workspace;
+  cv::Mat output;
+  for (auto _ : state) {
+    GuidedFilter(object, reference, &output, 11, 100, options);
+  }
+  SetPixelRate(state, object);
+}
+void GuidedFilterArgs(benchmark::internal::Benchmark *b) {
+  for (int resolution=0; resolution<3; resolution++) {
+    for (int channels : {1, 3}) {
+      b->Args({resolution, channels});
+    }
+  }
+  b->Unit(benchmark::kMillisecond);
+}
+BENCHMARK_CAPTURE(BM_GuidedFilter, integral,
+                  GuidedFilterOptions::kIntegralImageEngine, 1)
+    ->Apply(GuidedFilterArgs);
+BENCHMARK_CAPTURE(BM_GuidedFilter, box,
+                  GuidedFilterOptions::kBoxFilterEngine, 1)
+    ->Apply(GuidedFilterArgs);
+BENCHMARK_CAPTURE(BM_GuidedFilter, fast4,
+                  GuidedFilterOptions::kIntegralImageEngine, 4)
+    ->Apply(GuidedFilterArgs);
+
+// InPaint on demo/images/{rgb,missing}<i>.png.
+void BM_InPaintDemo(benchmark::State &state) {
+  std::string index = std::to_string(state.range(0));
+  cv::Mat rgb = cv::imread(GDFMM_DEMO_DIR "/rgb" + index + ".png",
+                           cv::IMREAD_COLOR);
+  cv::Mat depth = cv::imread(GDFMM_DEMO_DIR "/missing" + index + ".png",
+                             cv::IMREAD_UNCHANGED);
+  if (rgb.empty() || depth.empty() || depth.channels() != 1) {
+    state.SkipWithError("demo images not found");
+    return;
+  }
+  // the 8-bit demo depths are scaled like in demo/demo_rgb_orig.py
+  if (depth.depth() == CV_8U) {
+    depth.convertTo(depth, CV_16U, 10000 / 256);
+  }
+  cv::resize(rgb, rgb, cv::Size(depth.cols, depth.rows));
+
+  GDFMM gdfmm(2, 10, 1, 11);
+  gdfmm.SetOutputDepth(-1);
+  Workspace workspace;
+  cv::Mat output;
+  for (auto _ : state) {
+    gdfmm.InPaint(depth, rgb, &output, &workspace);
+  }
+  SetPixelRate(state, depth);
+}
+BENCHMARK(BM_InPaintDemo)->Arg(1)->Arg(2)->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+BENCHMARK_MAIN();
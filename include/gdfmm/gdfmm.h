@@ -2,17 +2,128 @@
 
 #include <opencv2/core/core.hpp>
 #include <memory>
+#include <vector>
 
 /** @file */
 namespace gdfmm {
 
 struct Point;
+class Pipeline;
+struct GDFMMInternals;
+
+/** \brief Timings and counters of the calls that used a Workspace.
+ *
+ * Only collected if the library is built with GDFMM_STATS defined
+ * (cmake -DGDFMM_STATS=ON); otherwise the instrumentation compiles to
+ * nothing and all fields stay zero.
+ *
+ * GDFMM::InPaint, GDFMM::InPaint2 and GDFMM::Enhance reset all fields.
+ * GuidedFilter only sets `filterSeconds`, so after Enhance, or InPaint
+ * followed by GuidedFilter on the same workspace, both stages are
+ * reported. Counters of tiled and grouped marches are summed over all
+ * tiles and groups.
+ * */
+struct Stats {
+  Stats() { Clear(); }
+  void Clear() {
+    inputSeconds = pyramidSeconds = blurSeconds = speedMapSeconds =
+        marchSeconds = predictSeconds = outputSeconds = filterSeconds = 0;
+    pushes = pops = retries = predictions = filledPixels = knownCount = 0;
+  }
+  /** \brief Mean number of known pixels in the window of a prediction. */
+  double AverageKnownCount() const {
+    return predictions > 0 ? static_cast<double>(knownCount) / predictions : 0;
+  }
+
+  // wall time of every stage, in seconds
+  double inputSeconds;     ///< Conversion of the input depth to float
+  /** Coarser levels of GDFMM::SetPyramidLevels, whose counters are not
+   * included below */
+  double pyramidSeconds;
+  double blurSeconds;      ///< Gaussian blur of the reference
+  double speedMapSeconds;  ///< Gradient and speed pre-pass
+  double marchSeconds;     ///< Fast march, including tiles and hole groups
+  /** Time spent in depth predictions, included in `marchSeconds`; summed
+   * over threads for parallel marches. */
+  double predictSeconds;
+  double outputSeconds;    ///< Conversion to the output type
+  double filterSeconds;    ///< GuidedFilter
+
+  long long pushes;        ///< Narrow-band pushes, including waiting pixels
+  long long pops;          ///< Narrow-band pops
+  long long retries;       ///< Pixels that waited for more known depths
+  long long predictions;   ///< Calls of the depth prediction
+  long long filledPixels;  ///< Pixels filled by the march
+  /** Known pixels in the prediction windows, summed over predictions */
+  long long knownCount;
+};
+
+/** \brief Reusable buffers for GDFMM::InPaint, GDFMM::InPaint2 and
+ * GuidedFilter.
+ *
+ * All intermediate images and the narrow band are sized on first use and
+ * reused as long as later frames have the same size, so steady-state calls
+ * on a stream do not allocate frame-sized memory. Pass an `output` of the
+ * right size and type as well, otherwise the result itself is allocated.
+ *
+ * A workspace may be shared between GDFMM instances and the guided filter,
+ * but not used by two calls at the same time.
+ * */
+class Workspace {
+  public:
+  Workspace();
+  ~Workspace();
+
+  /** \brief Internal buffers, defined in src/workspace.h */
+  struct Buffers;
+  Buffers *buffers() const { return buffers_.get(); }
+
+  /** \brief Timings and counters of the last calls, see Stats. */
+  const Stats &stats() const;
+
+  private:
+  std::unique_ptr<Buffers> buffers_;
+};
+
+/** \brief State carried between the frames of a depth stream, see
+ * GDFMM::InPaintStream.
+ *
+ * A pixel counts as changed if any color channel moved by more than
+ * `colorThreshold`, if it became known or missing, or if its known depth
+ * moved by more than `depthThreshold` (in the units of the depth image).
+ * */
+class InPaintSession {
+  public:
+  InPaintSession(float colorThreshold = 8.0f, float depthThreshold = 10.0f);
+
+  /** \brief Forgets the previous frame; the next frame is filled from
+   * scratch. */
+  void Reset();
+
+  /** \brief Number of missing pixels of the last frame that were taken
+   * from the previous frame instead of being marched over. */
+  int ReusedPixels() const { return reusedPixels_; }
+
+  /** \brief Timings and counters of the last frame, see Stats. */
+  const Stats &stats() const { return workspace_.stats(); }
+
+  private:
+  friend class GDFMM;
+  float colorThreshold_, depthThreshold_;
+  // previous input depth and filled result, CV_32F, and reference
+  cv::Mat depth_, rgb_, filled_;
+  // seeded depth of the current frame, its changed pixels (CV_8U) and
+  // their integral
+  cv::Mat seed_, changed_, changedI_;
+  int reusedPixels_;
+  Workspace workspace_;
+};
 
 /** \brief Class to hold the settings and caches for
  * guided depth enhancement.
  *
  * This class assumes either 3-channel 8-bit input image,
- * or a 1-channel image.
+ * or a 1-channel image. InPaint2 needs the 3-channel image.
  *
  * Depth values of zero are assumed to be missing and require
  * inpainting. Inpainting is performed with information from
@@ -31,9 +142,21 @@ struct Point;
  *
  * For details please refer to the original paper (Guided Depth
  * Enhancement via a Fast Marching Method).
+ *
+ * Thread safety: the const methods only read the settings and lookup
+ * tables, so one instance may be used by several threads at once, as
+ * long as each call has its own output, Workspace and InPaintSession.
+ * The setters must not run concurrently with any other call.
  * */
 class GDFMM {
   public:
+  /** \brief Container used for the fast-marching narrow band.
+   * */
+  enum QueuePolicy {
+    kHeapQueue,   ///< Exact binary heap over the speed values (default).
+    kBucketQueue  ///< Untidy bucket queue over quantized speed values.
+  };
+
   /** \brief Creates the exponential lookup tables
    * for the algorithm.
    * */
@@ -45,10 +168,88 @@ class GDFMM {
    *
    * \param[out] output If `output` is a pointer, the `cv::Mat` it
    * points to will be overwritten with the result.
+   * \param workspace If not null, intermediate buffers are taken from
+   * and kept in `workspace`.
    * */
   cv::Mat InPaint(const cv::Mat &depthImage,
                 const cv::Mat &rgbImageOriginal,
-                cv::Mat *output = nullptr);
+                cv::Mat *output = nullptr,
+                Workspace *workspace = nullptr) const;
+
+  /** \brief Inpaints the missing depths of a region of interest only.
+   *
+   * Only `roi`, grown by windowSize / 2 pixels for the prediction
+   * windows, is read, and only the missing pixels of `roi` where `mask`
+   * is non-zero are filled; the march does not pass through the other
+   * missing pixels. So the blur, the speed map and the march cost scale
+   * with the size of `roi` rather than of the frame. Filled depths can
+   * differ from those of InPaint on the whole frame where its march
+   * reaches `roi` through holes outside the target.
+   *
+   * @param[in] roi Part of the frame to complete
+   * @param[in] mask Empty for all of `roi`, or CV_8U of the size of
+   * `roi`, non-zero where missing pixels are filled
+   * @param[out] output See InPaint; the result has the size of `roi`
+   * @param workspace See InPaint.
+   * */
+  cv::Mat InPaint(const cv::Mat &depthImage,
+                  const cv::Mat &rgbImage,
+                  const cv::Rect &roi,
+                  const cv::Mat &mask = cv::Mat(),
+                  cv::Mat *output = nullptr,
+                  Workspace *workspace = nullptr) const;
+
+  /** \brief The full algorithm: InPaint followed by GuidedFilter.
+   *
+   * The guided filter runs directly on the single-precision inpainted
+   * depth, with `rgbImage` as reference, and both stages share the
+   * buffers of `workspace`. Same as
+   * GuidedFilter(InPaint(depth, rgb), rgb, ...) up to the rounding of the
+   * intermediate result.
+   *
+   * @param[in] filterWindowSize Window size of the guided filter
+   * @param[in] filterEpsilon Regularization of the guided filter
+   * @param[out] output See InPaint; the element type is chosen by
+   * SetOutputDepth.
+   * @param workspace See InPaint.
+   * */
+  cv::Mat Enhance(const cv::Mat &depthImage,
+                  const cv::Mat &rgbImage,
+                  int filterWindowSize,
+                  float filterEpsilon,
+                  cv::Mat *output = nullptr,
+                  Workspace *workspace = nullptr) const;
+
+  /** \brief Inpaints a batch of frames concurrently.
+   *
+   * Runs InPaint on every pair `depthImages[i]`, `rgbImages[i]`, spread over
+   * `numThreads` workers that share this instance's lookup tables; each
+   * worker keeps its own Workspace across the frames it processes.
+   *
+   * @param[in] numThreads Number of workers; 0 uses one per OpenCV worker
+   * thread (see cv::setNumThreads).
+   * @return The inpainted frames, in input order.
+   * */
+  std::vector<cv::Mat> InPaintBatch(const std::vector<cv::Mat> &depthImages,
+                                    const std::vector<cv::Mat> &rgbImages,
+                                    int numThreads = 0) const;
+
+  /** \brief InPaint for consecutive frames of a stream.
+   *
+   * Missing pixels whose neighbourhood (the prediction window) did not
+   * change since the previous frame keep their previous filled depth, and
+   * the march only fills the holes in changed regions, using the reused
+   * pixels as known depth. The first frame, and any frame of a different
+   * size or type, is filled from scratch.
+   *
+   * @param session Per-stream state; must not be shared by concurrent
+   * calls.
+   * @param[out] output See InPaint.
+   * */
+  cv::Mat InPaintStream(const cv::Mat &depthImage,
+                        const cv::Mat &rgbImage,
+                        InPaintSession *session,
+                        cv::Mat *output = nullptr) const;
 
   /** \brief An experimental alternative method to predict the depth
    * of unknown pixels by least-squares regression.
@@ -67,15 +268,140 @@ class GDFMM {
    * @param[in] truncation In every window with a depth range of
    * 		\f$\Delta f = f_\mathrm{max} - f_\mathrm{min}\f$, constrain depths
    * 		to the range \f$[f_\mathrm{min} - t\Delta f,
-   * 		f_\mathrm{max} + t\Delta f] \f$
+   * 		f_\mathrm{max} + t\Delta f] \f$. Negative values disable it;
+   * 		see SetIncrementalRegression.
+   * @param[out] output See InPaint.
+   * @param workspace See InPaint.
    * */
   cv::Mat InPaint2(const cv::Mat &depthImage,
                       const cv::Mat &rgbImageOriginal,
                       float epsilon = 0,
                       float constant = 1,
                       float truncation = 0.05,
-                      cv::Mat *output = nullptr);
+                      cv::Mat *output = nullptr,
+                      Workspace *workspace = nullptr) const;
+
+  /** \brief Selects the narrow-band container used by InPaint and InPaint2.
+   *
+   * The bucket queue orders pixels exactly only up to its bucket width of
+   * 1/256 in speed, so its results can differ slightly from the heap's,
+   * but it makes each push and pop O(1).
+   * */
+  void SetQueuePolicy(QueuePolicy policy);
+
+  /** \brief Makes InPaint2 keep running window statistics.
+   *
+   * Instead of rescanning the window for every filled pixel, InPaint2
+   * keeps \f$\sum I\f$, \f$\sum II^T\f$, \f$\sum D\f$, \f$\sum ID\f$ and the
+   * count for the window of every missing pixel, and updates them as the
+   * march fills pixels. Each prediction is then a constant-time 4x4 solve.
+   * The statistics are kept in double precision, so predictions differ
+   * from the window regression only by rounding. `truncation` is ignored
+   * in this mode, as the statistics do not keep the depth range.
+   * */
+  void SetIncrementalRegression(bool enabled);
+
+  /** \brief Adds the depth gradient term of the paper to InPaint.
+   *
+   * Every known pixel q in the window of p then predicts
+   * \f$D(q) + \nabla D(q) \cdot (p - q)\f$ instead of \f$D(q)\f$. Along
+   * each axis, \f$\nabla D(q)\f$ is the smaller of the differences to the
+   * two neighbours of q, 0 where they disagree in sign or are not both
+   * known, so that depth edges do not tilt the pixels next to them. The
+   * gradients are cached for the whole image and, when a pixel is filled,
+   * only updated at it and its 4-neighbours, so a prediction stays one
+   * pass over the window. Windows whose weighted extrapolation is not
+   * positive fall back to the plain weighted mean. Off by default;
+   * InPaint2 ignores it.
+   * */
+  void SetDepthGradient(bool enabled);
+
+  /** \brief Splits the march of large frames into tiles.
+   *
+   * Frames larger than `tileSize` in either direction are cut into
+   * `tileSize` x `tileSize` tiles, which are marched independently on
+   * `numThreads` workers (0: one per OpenCV worker thread) over the tile
+   * grown by windowSize / 2 pixels. Holes within windowSize / 2 of an
+   * inner tile edge, and holes a tile cannot fill on its own, are then
+   * filled by one serial march seeded with the tile results.
+   *
+   * Filled depths depend on the fill order, which changes with tiling,
+   * so results are not identical to the serial march. On the synthetic
+   * 260x200 frame of test_tiling in src/test.cc (depth of 1000 to 2000,
+   * 40 square holes), tiles of 40, 64 and 100 pixels change at most 8% of
+   * the filled pixels by more than 1 and none by more than 15. Compare
+   * against tileSize 0 to measure it on real data. 0 disables tiling
+   * (default).
+   * */
+  void SetTiling(int tileSize, int numThreads = 0);
+
+  /** \brief Marches independent holes in parallel.
+   *
+   * Missing pixels are grouped into connected holes, merging holes at
+   * most windowSize / 2 apart, so that no prediction window of one group
+   * reads a missing pixel of another. Each group is then marched on its
+   * own, over its bounding box grown by windowSize / 2, on `numThreads`
+   * workers (0: one per OpenCV worker thread). 1 marches all holes in one
+   * band (default). Takes precedence over SetTiling.
+   *
+   * Groups do not interact, so the result only differs from the single
+   * band by the order in which pixels of equal speed are popped.
+   * */
+  void SetHoleParallelism(int numThreads);
+
+  /** \brief Relaxed march order, with the predictions of every step in
+   * parallel.
+   *
+   * Instead of one pixel at a time, the march pops every narrow-band
+   * entry whose speed is within `delta` of the fastest one, predicts all
+   * the missing pixels they reach on `numThreads` workers (0: one per
+   * OpenCV worker thread) from the depths known before the step, and then
+   * fills them. Speeds are in [-1, 0), so a `delta` of 1 or more marches
+   * the whole front of every hole at once. Larger steps give more
+   * parallel work but follow the speed map less closely, and pixels of
+   * one step do not see each other. 0 keeps the exact order (default).
+   * Combines with SetQueuePolicy, SetTiling and SetHoleParallelism.
+   * */
+  void SetWavefront(float delta, int numThreads = 0);
+
+  /** \brief Element type of the inpainted images.
+   *
+   * CV_64F by default. -1 gives the depth type of the input, e.g. CV_16U
+   * for Kinect frames, with predictions rounded to the nearest value.
+   * CV_8U, CV_16U and CV_32F can also be chosen explicitly.
+   *
+   * With an `output` of the right size and type, the result is written
+   * into its existing buffer; `output` may also be the input depth image
+   * itself, which is then inpainted in place.
+   * */
+  void SetOutputDepth(int depth);
+
+  /** \brief Coarse-to-fine inpainting for large holes.
+   *
+   * With `levels` greater than 1, the depth (by the mean of the known
+   * pixels of every 2x2 block) and the reference are halved up to
+   * `levels` - 1 times, and every level is inpainted from the next
+   * coarser one: missing pixels whose window has too few known depths
+   * for a prediction are seeded with the bilinearly upsampled coarser
+   * result, so the march only fills a band of about windowSize / 2
+   * pixels along the known depths. The window size is the same at every
+   * level, and the coarser levels add at most a third of the work, so
+   * the cost stays linear in the pixels whatever the size of the holes.
+   * Halving stops once a side would be shorter than the window. 1
+   * disables it (default).
+   * */
+  void SetPyramidLevels(int levels);
+
+  /** \brief Computes the blur and the speed map with the cv::UMat
+   * ComputeSpeedMap of gdfmm/umat.h, on an OpenCL device when OpenCV has
+   * one. Only the speed map comes back for the march, which stays on the
+   * CPU. Off by default; enabling it throws std::runtime_error unless the
+   * library was built with GDFMM_OPENCL.
+   * */
+  void SetDeviceSpeedMap(bool enabled);
   private:
+  friend class Pipeline;
+  friend struct GDFMMInternals;
   class ExpCache {
     std::unique_ptr<float []> lookupTable;
     int tableSize_;
@@ -83,29 +409,167 @@ class GDFMM {
     public:
 
     ExpCache(float sigma, int tableSize);
-    float operator()(int d);
+    float operator()(int d) const;
+    /** \brief Pointer to the entry for zero; valid for indices in
+     * [-tableSize, tableSize]. */
+    const float *Centered() const { return lookupTable.get() + tableSize_; }
   };
 
+  /* The march. The result is converted to `outputDepth`; if that is
+   * negative, it is only left in the CV_32F depth buffer of `workspace`
+   * (which must then be given) and an empty image is returned. */
   template <class PredictMethod>
   cv::Mat InPaintBase(const cv::Mat &depthImage,
                       const cv::Mat &rgbImageOriginal,
-                      cv::Mat *output = nullptr,
-                      const PredictMethod &predict = PredictMethod());
-  float BilateralWeight(const Point &p1,
-                        const Point &p2,
-                        const cv::Mat &rgbImage);
+                      cv::Mat *output,
+                      int outputDepth,
+                      Workspace *workspace,
+                      PredictMethod *predict) const;
+  /* InPaint with an explicit outputDepth, see InPaintBase */
+  cv::Mat InPaintTo(const cv::Mat &depthImage,
+                    const cv::Mat &rgbImage,
+                    cv::Mat *output,
+                    int outputDepth,
+                    Workspace *workspace) const;
+  /* InPaint for a window size (0: windowSize_) and guide channel count
+   * fixed at compile time; InPaint dispatches to it. */
+  template <int kWindowSize, int kChannels>
+  cv::Mat InPaintFixed(const cv::Mat &depthImage,
+                       const cv::Mat &rgbImage,
+                       cv::Mat *output,
+                       int outputDepth,
+                       Workspace *workspace) const;
+  /* The input conversion and speed map of InPaint, into `workspace`;
+   * the next InPaintTo on `workspace` only marches. */
+  void Prepare(const cv::Mat &depthImage,
+               const cv::Mat &rgbImage,
+               Workspace *workspace) const;
+  // blur and speed map of `rgbImage` into `buffers`
+  void ComputeSpeed(const cv::Mat &rgbImage,
+                    Workspace::Buffers *buffers) const;
+  /* The guided filter of Enhance, over the inpainted depth buffer of
+   * `workspace`; the result has the element type of InPaint. */
+  cv::Mat FilterInPainted(const cv::Mat &depthImage,
+                          const cv::Mat &rgbImage,
+                          int filterWindowSize,
+                          float filterEpsilon,
+                          cv::Mat *output,
+                          Workspace *workspace) const;
+  /* Fills the CV_32F depth buffer of `buffers` in place, after seeding
+   * it from `levels` - 1 coarser levels. Unless `speedMapReady`, the
+   * speed map is computed first. */
+  template <class PredictMethod>
+  void MarchLevel(const cv::Mat &rgbImage,
+                  int levels,
+                  bool speedMapReady,
+                  Workspace::Buffers *buffers,
+                  PredictMethod *predict) const;
+  template <class PredictMethod>
+  void SeedFromCoarser(const cv::Mat &rgbImage,
+                       int levels,
+                       Workspace::Buffers *buffers,
+                       const PredictMethod &predict) const;
+  // element type of the results for inputs like `depthImage`
+  int OutputDepth(const cv::Mat &depthImage) const;
+  /* The predictions; `knownCount` receives the number of known pixels
+   * in the window in GDFMM_STATS builds. */
+  template <int kWindowSize, int kChannels>
   float PredictDepth(const cv::Mat &depthImage,
                      const cv::Mat &rgbImage,
-                     int x, int y);
+                     int x, int y,
+                     int *knownCount) const;
+  template <int kChannels>
+  float PredictDepthGradient(const cv::Mat &depthImage,
+                             const cv::Mat &gradient,
+                             const cv::Mat &rgbImage,
+                             int x, int y,
+                             int *knownCount) const;
   float PredictDepth2(const cv::Mat &depthImage,
                      const cv::Mat &rgbImage,
                      int x, int y,
                      float epsilon,
                      float constant,
-                     float truncation);
+                     float truncation,
+                     int *knownCount) const;
   ExpCache distExpCache_, colorExpCache_;
   unsigned int windowSize_, blurSigma_;
+  QueuePolicy queuePolicy_;
+  bool incrementalRegression_;
+  bool depthGradient_;
+  int tileSize_, tileThreads_;
+  int holeThreads_;
+  int outputDepth_;
+  int pyramidLevels_;
+  bool deviceSpeedMap_;
+  float wavefrontDelta_;
+  int wavefrontThreads_;
+  // distExpCache_(dx) * distExpCache_(dy), windowSize_ x windowSize_
+  std::unique_ptr<float []> spatialKernel_;
 };
+/** \brief Settings for the guided filter.
+ * */
+struct GuidedFilterOptions {
+  /** \brief How the window sums are computed.
+   * */
+  enum Engine {
+    /** Double-precision integral images of the whole frame (default). */
+    kIntegralImageEngine,
+    /** Single-precision running box sums. Temporaries scale with a few
+     * rows of the image rather than the whole frame; see BoxGuidedFilter
+     * in src/box_guided_filter.h for the error bound. */
+    kBoxFilterEngine,
+    /** The cv::UMat GuidedFilter of gdfmm/umat.h, on an OpenCL device
+     * when OpenCV has one; the images are uploaded and the result is
+     * downloaded. Only available in builds with GDFMM_OPENCL; throws
+     * otherwise. */
+    kOpenCLEngine
+  };
+
+  /** \brief Arithmetic of the integral-image engine for 3-channel
+   * references; 1-channel references and `subsample` > 1 always use
+   * kDoublePrecision.
+   *
+   * Errors are the largest absolute differences from a filter computed
+   * entirely in double precision, on the synthetic 640x480 frame of
+   * test_guided_filter_precision in src/test.cc (16-bit sloped depth of
+   * 1000 to 2500, noisy 8-bit references), for windows of 5, 11 and 21
+   * and epsilon of 1, 10 and 100. The test checks every one of them.
+   * */
+  enum Precision {
+    /** CV_64F integral images of the whole frame (default). Error below
+     * 0.012, from the single-precision coefficients. */
+    kDoublePrecision,
+    /** CV_32F integral images of 64x64 tiles grown by windowSize / 2,
+     * with the inputs centred on the mean of the tile. Error below 0.16.
+     * The integral images take a fraction of the memory and stay in
+     * cache. */
+    kFloatPrecision,
+    /** As kFloatPrecision, with Kahan-compensated sums when the integral
+     * images are built. Error below 0.03. */
+    kCompensatedPrecision
+  };
+
+  GuidedFilterOptions()
+    : numThreads(1), engine(kIntegralImageEngine),
+      precision(kDoublePrecision), subsample(1), workspace(nullptr) {}
+
+  /** Number of row bands processed in parallel. 1 runs on the calling
+   * thread; 0 uses one band per OpenCV worker thread (cv::setNumThreads
+   * sets the pool size). */
+  int numThreads;
+  Engine engine;
+  Precision precision;
+  /** Fast guided filter (He & Sun, 2015): if greater than 1, the A/B
+   * coefficients are computed on the images subsampled by this factor,
+   * with the window radius divided by it, and upsampled bilinearly
+   * before the final \f$A \cdot I + B\f$. Costs roughly 1/subsample^2
+   * of the full filter. `engine` is ignored in this mode. */
+  int subsample;
+  /** If not null, the integral-image engine keeps its intermediate images
+   * here (see Workspace), and the filter time goes into its Stats. */
+  Workspace *workspace;
+};
+
 /** \brief Guided filter. Apply this to the image for the full algorithm.
  *
  * */
@@ -115,6 +579,33 @@ cv::Mat GuidedFilter(const cv::Mat &object,
                      int windowSize,
                      float epsilon);
 
+/** \brief Guided filter with explicit settings.
+ * */
+cv::Mat GuidedFilter(const cv::Mat &object,
+                     const cv::Mat &reference,
+                     cv::Mat *output,
+                     int windowSize,
+                     float epsilon,
+                     const GuidedFilterOptions &options);
+
+/** \brief Guided filter of a region of interest only.
+ *
+ * The result of GuidedFilter on the whole frame, cropped to `roi`, up to
+ * rounding (for `options.subsample` 1), from `roi` grown by
+ * 2 * (windowSize / 2) pixels only; so the cost scales with the size of
+ * `roi` rather than of the frame.
+ *
+ * @param[out] output If not null, overwritten with the result, which has
+ * the size of `roi`.
+ * */
+cv::Mat GuidedFilter(const cv::Mat &object,
+                     const cv::Mat &reference,
+                     const cv::Rect &roi,
+                     cv::Mat *output,
+                     int windowSize,
+                     float epsilon,
+                     const GuidedFilterOptions &options = GuidedFilterOptions());
+
 /** \brief Internally-used class
  **/
 struct Point {
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "gdfmm/gdfmm.h"
+
+#include <opencv2/core/core.hpp>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+
+/** @file */
+namespace gdfmm {
+
+/** \brief Runs GDFMM::Enhance over a stream of frames, with the stages of
+ * consecutive frames overlapped.
+ *
+ * Every stage has a thread of its own:
+ *   1. the reference is resized to the depth image if their sizes differ,
+ *      the depth is converted and the speed map computed (blur and
+ *      gradient pre-pass),
+ *   2. the march,
+ *   3. the guided filter and the conversion to the output type.
+ *
+ * So while frame N is marched, the speed map of frame N+1 and the guided
+ * filter of frame N-1 are computed, and the throughput is that of the
+ * slowest stage rather than of all three. The stages are connected by
+ * queues of at most `queueSize` frames; Submit blocks while the first one
+ * is full.
+ *
+ * Results are those of GDFMM::Enhance (or of GDFMM::InPaint without a
+ * filter) and are delivered in submission order. Every frame in flight has
+ * a Workspace of its own; workspaces are reused, so once the pipeline is
+ * full only the results are allocated.
+ *
+ * The GDFMM instance must outlive the pipeline, and must not be changed
+ * while frames are in flight. Submit and Flush may be called from any
+ * thread.
+ * */
+class Pipeline {
+  public:
+  /** \brief Receives the result of a frame, on the thread of the last
+   * stage, or an empty image and the exception a stage threw. Must not
+   * throw.
+   * */
+  typedef std::function<void (const cv::Mat &result,
+                              std::exception_ptr error)> Callback;
+
+  /**
+   * @param[in] gdfmm Settings of the inpainting
+   * @param[in] filterWindowSize Window size of the guided filter, 0 to
+   * skip the filter
+   * @param[in] filterEpsilon Regularization of the guided filter
+   * @param[in] queueSize Number of frames each queue between stages holds
+   * */
+  Pipeline(const GDFMM &gdfmm,
+           int filterWindowSize,
+           float filterEpsilon,
+           int queueSize = 2);
+  /** \brief Completes the frames in flight, then stops the threads. */
+  ~Pipeline();
+
+  /** \brief Queues a frame.
+   *
+   * The images are not copied, so they must not be written to until the
+   * result of the frame has been delivered.
+   *
+   * @return The result; get() rethrows the exception of a failed stage.
+   * */
+  std::future<cv::Mat> Submit(const cv::Mat &depthImage,
+                              const cv::Mat &rgbImage);
+  /** \brief Queues a frame whose result is passed to `done`. */
+  void Submit(const cv::Mat &depthImage,
+              const cv::Mat &rgbImage,
+              Callback done);
+
+  /** \brief Waits until the results of all frames submitted so far have
+   * been delivered. */
+  void Flush();
+
+  Pipeline(const Pipeline &) = delete;
+  Pipeline &operator=(const Pipeline &) = delete;
+
+  private:
+  struct Frame;
+  class FrameQueue;
+  struct State;
+
+  // runs `stage` on every frame of `in`, then passes it to `out`, or
+  // completes it if `out` is null
+  void Run(FrameQueue *in, FrameQueue *out, void (Pipeline::*stage)(Frame *));
+  void PrepareFrame(Frame *frame);
+  void MarchFrame(Frame *frame);
+  void FilterFrame(Frame *frame);
+  void Complete(std::unique_ptr<Frame> frame);
+
+  const GDFMM &gdfmm_;
+  int filterWindowSize_;
+  float filterEpsilon_;
+  std::unique_ptr<State> state_;
+};
+
+}  // namespace gdfmm
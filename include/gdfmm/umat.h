@@ -0,0 +1,51 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+
+/** @file
+ * cv::UMat variants of the data-parallel stages, for images that already
+ * live on an OpenCL device. They run through OpenCV's transparent API,
+ * on the device when cv::ocl::useOpenCL() and on the CPU otherwise.
+ *
+ * Only available in builds with GDFMM_OPENCL (cmake -DGDFMM_OPENCL=ON),
+ * which needs OpenCV 3 or later.
+ * */
+namespace gdfmm {
+
+/** \brief Guided filter of device images.
+ *
+ * Same filter as GuidedFilter, for 1- or 3-channel references, from box
+ * sums over the part of every window inside the image; the reference
+ * variances are normalized like GuidedFilter's, over n - 1 for 3 channels.
+ * The sums are in single precision, over inputs centred on their means.
+ *
+ * Results differ from GuidedFilter by rounding. Run on the CPU, on the
+ * synthetic frames of GuidedFilterOptions::Precision, the difference was
+ * below 0.17 for 3-channel references with windows of 5 to 21, 0.71 for a
+ * window of 3 (from the single-precision 3x3 solve), and 0.02 for
+ * 1-channel references.
+ *
+ * @param[out] output If not null, overwritten with the result.
+ * @return The result, with the depth of `object`.
+ * */
+cv::UMat GuidedFilter(const cv::UMat &object,
+                      const cv::UMat &reference,
+                      cv::UMat *output,
+                      int windowSize,
+                      float epsilon);
+
+/** \brief Fast-marching speed of every pixel of a device image.
+ *
+ * The Gaussian blur of GDFMM::InPaint followed by ComputeSpeedMap: the
+ * squared 3x3 Sobel gradients of the blurred image, summed over all
+ * channels into g, give the speed -1 / (1 + g).
+ *
+ * @param[in] rgbImage 8-bit reference image with any number of channels
+ * @param[in] blurSigma Standard deviation of the blur
+ * @param[out] speed CV_32F speed map
+ * */
+void ComputeSpeedMap(const cv::UMat &rgbImage,
+                     float blurSigma,
+                     cv::UMat *speed);
+
+}  // namespace gdfmm
@@ -1,31 +1,170 @@
 cimport numpy as np
 import numpy as np
 
-cdef extern from "<cstdio>":
-    void printf(const char *c, void *p)
-
-cdef extern from "<cstdlib>":
-    void *memcpy(void *dst, const void *src, unsigned int n)
+np.import_array()
 
 cdef extern from "<opencv2/core/core.hpp>":
-    cdef int CV_8UC3
+    cdef int CV_8U
     cdef int CV_16U
+    cdef int CV_32F
+    cdef int CV_64F
+    int CV_MAKETYPE(int depth, int channels)
 
-cdef extern from "<opencv2/core/core.hpp>" namespace "cv":
+cdef extern from "<opencv2/core/core.hpp>" namespace "cv" nogil:
     cdef cppclass Mat:
         int rows
         int cols
         unsigned char *data
-        Mat(int rows, int cols, int typ)
-        Mat(int rows, int cols, int typ, void *data)
         Mat()
-        void create(int rows, int cols, int typ)
+        Mat(int rows, int cols, int typ, void *data, size_t step)
+
+cdef extern from "../include/gdfmm/gdfmm.h" namespace "gdfmm" nogil:
+    cdef cppclass CWorkspace "gdfmm::Workspace":
+        CWorkspace()
+
+    cdef cppclass CGDFMM "gdfmm::GDFMM":
+        CGDFMM(float sigma_dist, float sigma_color, float blur_sigma, int wsize) except +
+        Mat InPaint(const Mat &depth, const Mat &rgb,
+                    Mat *output, CWorkspace *workspace) except +
+        Mat InPaint2(const Mat &depth, const Mat &rgb,
+                     float epsilon, float constant, float truncation,
+                     Mat *output, CWorkspace *workspace) except +
+        Mat Enhance(const Mat &depth, const Mat &rgb,
+                    int filterWindowSize, float filterEpsilon,
+                    Mat *output, CWorkspace *workspace) except +
+        void SetOutputDepth(int depth) except +
+
+    cdef cppclass GuidedFilterOptions:
+        GuidedFilterOptions()
+        int numThreads
+        int subsample
+
+    Mat GuidedFilter(const Mat &object, const Mat &reference, Mat *output,
+                     int windowSize, float epsilon,
+                     const GuidedFilterOptions &options) except +
+
+# Wraps a C-contiguous array as a cv::Mat header over the same memory.
+cdef Mat _wrap(np.ndarray a) except *:
+    cdef int depth
+    if not np.PyArray_IS_C_CONTIGUOUS(a):
+        raise ValueError("arrays must be C-contiguous")
+    if a.dtype == np.uint8:
+        depth = CV_8U
+    elif a.dtype == np.uint16:
+        depth = CV_16U
+    elif a.dtype == np.float32:
+        depth = CV_32F
+    elif a.dtype == np.float64:
+        depth = CV_64F
+    else:
+        raise TypeError("unsupported dtype %s" % a.dtype)
+    if a.ndim == 2:
+        channels = 1
+    elif a.ndim == 3:
+        channels = a.shape[2]
+    else:
+        raise ValueError("arrays must have 2 or 3 dimensions")
+    return Mat(a.shape[0], a.shape[1], CV_MAKETYPE(depth, channels),
+               np.PyArray_DATA(a), a.strides[0])
+
+# Checks or allocates the output array, with the shape and dtype of `like`.
+cdef np.ndarray _output(np.ndarray like, out):
+    if out is None:
+        return np.empty((like.shape[0], like.shape[1]), dtype=like.dtype)
+    if (out.shape != (like.shape[0], like.shape[1]) or
+            out.dtype != like.dtype or not out.flags['C_CONTIGUOUS']):
+        raise ValueError("out must be a C-contiguous %s array of shape %s" %
+                         (like.dtype, (like.shape[0], like.shape[1])))
+    return out
+
+cdef class Workspace:
+    """Reusable buffers for repeated calls on frames of the same size.
+
+    A workspace must not be used by two calls at the same time; give every
+    worker thread its own.
+    """
+    cdef CWorkspace *thisptr
+
+    def __cinit__(self):
+        self.thisptr = new CWorkspace()
+
+    def __dealloc__(self):
+        del self.thisptr
+
+cdef CWorkspace *_workspace(workspace) except? NULL:
+    if workspace is None:
+        return NULL
+    return (<Workspace?>workspace).thisptr
+
+cdef class GDFMM:
+    """Guided fast-marching inpainting with persistent lookup tables.
+
+    Results have the dtype of the depth input and are written into `out`
+    when it is given. The GIL is released while inpainting, so one instance
+    may be used from several threads, each with its own `out` and
+    `workspace`.
+    """
+    cdef CGDFMM *thisptr
+
+    def __cinit__(self,
+                  float sigma_distance=1.0,
+                  float sigma_color=10,
+                  float blur_sigma=1,
+                  int window_size=7):
+        self.thisptr = new CGDFMM(sigma_distance, sigma_color, blur_sigma,
+                                  window_size)
+        self.thisptr.SetOutputDepth(-1)
+
+    def __dealloc__(self):
+        del self.thisptr
 
-cdef extern from "../include/gdfmm/gdfmm.h" namespace "gdfmm":
-    cdef cppclass GDFMM:
-        GDFMM(float sigma_dist, float sigma_color, float blur_sigma, int wsize);
-        Mat InPaint(const Mat &depth, const Mat &rgb) except +
-        Mat InPaint2(const Mat &depth, const Mat &rgb, float epsilon, float constant) except +
+    def inpaint(self, np.ndarray dep, np.ndarray rgb, out=None,
+                workspace=None):
+        cdef np.ndarray rv = _output(dep, out)
+        cdef Mat depM = _wrap(dep), rgbM = _wrap(rgb), rvM = _wrap(rv)
+        cdef CWorkspace *ws = _workspace(workspace)
+        with nogil:
+            self.thisptr.InPaint(depM, rgbM, &rvM, ws)
+        return rv
+
+    def inpaint2(self, np.ndarray dep, np.ndarray rgb,
+                 float epsilon=0, float constant=1, float truncation=0.05,
+                 out=None, workspace=None):
+        cdef np.ndarray rv = _output(dep, out)
+        cdef Mat depM = _wrap(dep), rgbM = _wrap(rgb), rvM = _wrap(rv)
+        cdef CWorkspace *ws = _workspace(workspace)
+        with nogil:
+            self.thisptr.InPaint2(depM, rgbM, epsilon, constant, truncation,
+                                  &rvM, ws)
+        return rv
+
+    def enhance(self, np.ndarray dep, np.ndarray rgb,
+                int filter_window_size, float filter_epsilon,
+                out=None, workspace=None):
+        """inpaint() followed by guided_filter(), in one call."""
+        cdef np.ndarray rv = _output(dep, out)
+        cdef Mat depM = _wrap(dep), rgbM = _wrap(rgb), rvM = _wrap(rv)
+        cdef CWorkspace *ws = _workspace(workspace)
+        with nogil:
+            self.thisptr.Enhance(depM, rgbM, filter_window_size,
+                                 filter_epsilon, &rvM, ws)
+        return rv
+
+def guided_filter(np.ndarray obj, np.ndarray ref, int window_size,
+                  float epsilon, out=None, int num_threads=1,
+                  int subsample=1):
+    """Guided filter of `obj` with reference `ref` (1 or 3 channels).
+
+    The result has the dtype of `obj`, and is written into `out` if given.
+    """
+    cdef np.ndarray rv = _output(obj, out)
+    cdef Mat objM = _wrap(obj), refM = _wrap(ref), rvM = _wrap(rv)
+    cdef GuidedFilterOptions options
+    options.numThreads = num_threads
+    options.subsample = subsample
+    with nogil:
+        GuidedFilter(objM, refM, &rvM, window_size, epsilon, options)
+    return rv
 
 def InpaintDepth2(np.ndarray[float, ndim=2, mode="c"] dep,
                  np.ndarray[np.uint8_t, ndim=3, mode="c"] rgb,
@@ -35,24 +174,9 @@ def InpaintDepth2(np.ndarray[float, ndim=2, mode="c"] dep,
                  float sigma_color = 10,
                  float blur_sigma = 1,
                  int window_size = 7):
-    cdef Mat rgbM, depM, rvM
-    rv = np.zeros((dep.shape[0], dep.shape[1]), dtype=np.float64, order="C")
-
-    rgbM = Mat(rgb.shape[0], rgb.shape[1], CV_8UC3, np.PyArray_DATA(rgb))
-    depM = Mat(dep.shape[0], dep.shape[1], float, np.PyArray_DATA(dep))
-
-    cdef void *p
-    p = np.PyArray_DATA(dep)
-
-    cdef GDFMM *gdfmm;
-    gdfmm = new GDFMM(sigma_distance, sigma_color, blur_sigma, window_size);
-    rvM = gdfmm.InPaint2(depM, rgbM, epsilon, constant)
-
-    del gdfmm
-    memcpy(np.PyArray_DATA(rv),
-           rvM.data,
-           8*dep.shape[0]*dep.shape[1])
-    return rv
+    rv = GDFMM(sigma_distance, sigma_color, blur_sigma, window_size).inpaint2(
+        dep, rgb, epsilon, constant)
+    return np.asarray(rv, dtype=np.float64)
 
 def InpaintDepth(np.ndarray[np.uint16_t, ndim=2, mode="c"] dep,
                  np.ndarray[np.uint8_t, ndim=3, mode="c"] rgb,
@@ -60,22 +184,5 @@ def InpaintDepth(np.ndarray[np.uint16_t, ndim=2, mode="c"] dep,
                  float sigma_color = 10,
                  float blur_sigma = 1,
                  int window_size = 7):
-    cdef Mat rgbM, depM, rvM
-    rv = np.zeros((dep.shape[0], dep.shape[1]), dtype=np.uint16, order="C")
-
-    rgbM = Mat(rgb.shape[0], rgb.shape[1], CV_8UC3, np.PyArray_DATA(rgb))
-    depM = Mat(dep.shape[0], dep.shape[1], CV_16U, np.PyArray_DATA(dep))
-
-    cdef void *p
-    p = np.PyArray_DATA(dep)
-#    print atoi(int(p))
-
-    cdef GDFMM *gdfmm;
-    gdfmm = new GDFMM(sigma_distance, sigma_color, blur_sigma, window_size);
-    rvM = gdfmm.InPaint(depM, rgbM)
-
-    del gdfmm
-    memcpy(np.PyArray_DATA(rv),
-           rvM.data,
-           2*dep.shape[0]*dep.shape[1])
-    return rv
+    return GDFMM(sigma_distance, sigma_color, blur_sigma, window_size).inpaint(
+        dep, rgb)
@@ -0,0 +1,304 @@
+#include "box_guided_filter.h"
+#include "parallel.h"
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <vector>
+#include <cassert>
+
+#include <eigen3/Eigen/Eigen>
+
+namespace gdfmm {
+
+// Layout of the per-pixel terms for a C-channel reference:
+// I, the upper triangle of I I^T, p and I p.
+template <int C>
+struct BoxTerms {
+  static const int kProducts = C * (C + 1) / 2;
+  static const int kRef = 0;
+  static const int kRefRef = C;
+  static const int kObj = C + kProducts;
+  static const int kObjRef = kObj + 1;
+  static const int kCount = kObjRef + C;
+  // A, then B
+  static const int kCoefficients = C + 1;
+};
+
+template <int C>
+static void Coefficients(const float *sums, int n, float epsilon,
+                         float *coefficients);
+
+// same estimate as the 1-channel GuidedFilter
+template <>
+void Coefficients<1>(const float *sums, int n, float epsilon,
+                     float *coefficients) {
+  typedef BoxTerms<1> T;
+  float ref_mean = sums[T::kRef] / n;
+  float obj_mean = sums[T::kObj] / n;
+  float variance = sums[T::kRefRef] / n - ref_mean * ref_mean;
+  float a = (sums[T::kObjRef] / n - ref_mean * obj_mean) / (variance + epsilon);
+  coefficients[0] = a;
+  coefficients[1] = obj_mean - a * ref_mean;
+}
+
+// same estimate as GuidedFilter3
+template <>
+void Coefficients<3>(const float *sums, int n, float epsilon,
+                     float *coefficients) {
+  typedef BoxTerms<3> T;
+  static const int product[3][3] = {{0, 1, 2}, {1, 3, 4}, {2, 4, 5}};
+  Eigen::Matrix3f covariance;
+  Eigen::Vector3f ref_mean, objref_mean;
+  float obj_mean = sums[T::kObj] / n;
+  for (int i=0; i<3; i++) {
+    ref_mean(i) = sums[T::kRef + i] / n;
+    objref_mean(i) = sums[T::kObjRef + i] / n;
+    for (int j=0; j<3; j++) {
+      covariance(i, j) = sums[T::kRefRef + product[i][j]] / (n - 1) -
+          sums[T::kRef + i] * sums[T::kRef + j] / n / (n - 1);
+    }
+    covariance(i, i) += epsilon;
+  }
+  Eigen::Vector3f a = covariance.ldlt().solve(objref_mean - ref_mean * obj_mean);
+  for (int i=0; i<3; i++) {
+    coefficients[i] = a(i);
+  }
+  coefficients[3] = obj_mean - a.dot(ref_mean);
+}
+
+// The running sums below are recomputed from scratch after this many
+// steps, so their float rounding error does not grow with the size of the
+// image.
+static const int kReanchorInterval = 64;
+
+/* Running sums over the rows of a sliding window, one entry per column
+ * and term, plus the horizontal pass over them. */
+class ColumnSums {
+  public:
+  ColumnSums(int cols, int terms)
+    : cols_(cols), terms_(terms), sums_(cols * terms, 0.0f) {}
+
+  void Add(const float *row, float sign) {
+    for (int i=0; i<cols_ * terms_; i++) {
+      sums_[i] += sign * row[i];
+    }
+  }
+
+  void Clear() {
+    std::fill(sums_.begin(), sums_.end(), 0.0f);
+  }
+
+  // Calls f(x, windowSums, count) for every column, where windowSums are
+  // the sums over columns [x - radius, x + radius] clipped to the image.
+  template <class F>
+  void Sweep(int radius, F f) const {
+    std::vector<float> window(terms_, 0.0f);
+    for (int x=0; x<std::min(radius, cols_); x++) {
+      Accumulate(&window[0], x, 1);
+    }
+    for (int x=0; x<cols_; x++) {
+      if (x > 0 && x % kReanchorInterval == 0) {
+        std::fill(window.begin(), window.end(), 0.0f);
+        for (int m = std::max(0, x - radius);
+             m <= std::min(cols_ - 1, x + radius);
+             m++) {
+          Accumulate(&window[0], m, 1);
+        }
+      }
+      else {
+        if (x + radius < cols_)
+          Accumulate(&window[0], x + radius, 1);
+        if (x - radius - 1 >= 0)
+          Accumulate(&window[0], x - radius - 1, -1);
+      }
+      int count = std::min(cols_ - 1, x + radius) - std::max(0, x - radius) + 1;
+      f(x, &window[0], count);
+    }
+  }
+
+  private:
+  void Accumulate(float *window, int x, float sign) const {
+    const float *column = &sums_[x * terms_];
+    for (int k=0; k<terms_; k++) {
+      window[k] += sign * column[k];
+    }
+  }
+
+  int cols_, terms_;
+  std::vector<float> sums_;
+};
+
+// Filters output rows [outBegin, outEnd) into `result`, which has the
+// size of `object`; rows of other depths than CV_32F are converted from
+// one row of floats.
+template <int C>
+static void FilterBand(const cv::Mat &object,
+                       const cv::Mat &reference,
+                       float objectOffset,
+                       const float *referenceOffset,
+                       int windowSize,
+                       float epsilon,
+                       int outBegin, int outEnd,
+                       cv::Mat *result) {
+  typedef BoxTerms<C> T;
+  const int rows = object.rows, cols = object.cols;
+  const int radius = windowSize / 2;
+  const int ringRows = 2 * radius + 2;
+
+  cv::Mat objectRow(1, cols, CV_32F);
+  cv::Mat referenceRow(1, cols, CV_MAKETYPE(CV_32F, C));
+  cv::Mat resultRow(1, cols, CV_32F);
+  const bool floatResult = result->depth() == CV_32F;
+  std::vector<float> terms(cols * T::kCount);
+  std::vector<float> ring(ringRows * cols * T::kCoefficients);
+  ColumnSums termSums(cols, T::kCount);
+  ColumnSums coefficientSums(cols, T::kCoefficients);
+
+  // loads row y of the reference, centred
+  auto loadReference = [&](int y) -> const float * {
+    reference.row(y).convertTo(referenceRow, CV_32F);
+    float *ref = referenceRow.ptr<float>(0);
+    for (int x=0; x<cols; x++) {
+      for (int c=0; c<C; c++) {
+        ref[x * C + c] -= referenceOffset[c];
+      }
+    }
+    return ref;
+  };
+  auto addTerms = [&](int y, float sign) {
+    const float *ref = loadReference(y);
+    object.row(y).convertTo(objectRow, CV_32F);
+    const float *obj = objectRow.ptr<float>(0);
+    for (int x=0; x<cols; x++) {
+      float *t = &terms[x * T::kCount];
+      const float *I = ref + x * C;
+      float p = obj[x] - objectOffset;
+      int k = T::kRefRef;
+      for (int i=0; i<C; i++) {
+        t[T::kRef + i] = I[i];
+        for (int j=i; j<C; j++) {
+          t[k++] = I[i] * I[j];
+        }
+        t[T::kObjRef + i] = I[i] * p;
+      }
+      t[T::kObj] = p;
+    }
+    termSums.Add(&terms[0], sign);
+  };
+
+  // Coefficient rows [coefficientBegin, ...) are computed on demand, and
+  // need the terms of rows [termBegin, ...).
+  const int coefficientBegin = std::max(0, outBegin - radius);
+  const int termBegin = std::max(0, coefficientBegin - radius);
+  for (int y = termBegin; y < std::min(rows, coefficientBegin + radius); y++) {
+    addTerms(y, 1);
+  }
+  auto ringRow = [&](int y) {
+    return &ring[(y % ringRows) * cols * T::kCoefficients];
+  };
+  auto computeCoefficientRow = [&](int y) {
+    if ((y - coefficientBegin) % kReanchorInterval == kReanchorInterval - 1) {
+      termSums.Clear();
+      for (int n = std::max(termBegin, y - radius);
+           n <= std::min(rows - 1, y + radius);
+           n++) {
+        addTerms(n, 1);
+      }
+    }
+    else {
+      if (y + radius < rows)
+        addTerms(y + radius, 1);
+      if (y - radius - 1 >= termBegin)
+        addTerms(y - radius - 1, -1);
+    }
+    int rowCount = std::min(rows - 1, y + radius) - std::max(0, y - radius) + 1;
+    float *coefficients = ringRow(y);
+    termSums.Sweep(radius, [&](int x, const float *sums, int colCount) {
+      Coefficients<C>(sums, rowCount * colCount, epsilon,
+                      coefficients + x * T::kCoefficients);
+    });
+  };
+
+  int nextCoefficientRow = coefficientBegin;
+  for (int y = outBegin; y < outEnd; y++) {
+    for (; nextCoefficientRow <= std::min(rows - 1, y + radius);
+         nextCoefficientRow++) {
+      computeCoefficientRow(nextCoefficientRow);
+      coefficientSums.Add(ringRow(nextCoefficientRow), 1);
+    }
+    if ((y - outBegin) % kReanchorInterval == kReanchorInterval - 1) {
+      // the ring still holds every row of the window
+      coefficientSums.Clear();
+      for (int n = std::max(coefficientBegin, y - radius);
+           n <= std::min(rows - 1, y + radius);
+           n++) {
+        coefficientSums.Add(ringRow(n), 1);
+      }
+    }
+    else if (y - radius - 1 >= coefficientBegin) {
+      coefficientSums.Add(ringRow(y - radius - 1), -1);
+    }
+
+    int rowCount = std::min(rows - 1, y + radius) - std::max(0, y - radius) + 1;
+    const float *ref = loadReference(y);
+    float *out = floatResult ? result->ptr<float>(y)
+                             : resultRow.ptr<float>(0);
+    coefficientSums.Sweep(radius, [&](int x, const float *sums, int colCount) {
+      float n = static_cast<float>(rowCount * colCount);
+      float q = sums[C] / n + objectOffset;
+      for (int c=0; c<C; c++) {
+        q += sums[c] / n * ref[x * C + c];
+      }
+      out[x] = q;
+    });
+    if (!floatResult) {
+      cv::Mat outputRow = result->row(y);
+      resultRow.convertTo(outputRow, result->depth());
+    }
+  }
+}
+
+cv::Mat BoxGuidedFilter(const cv::Mat &object,
+                        const cv::Mat &reference,
+                        cv::Mat *output,
+                        int windowSize,
+                        float epsilon,
+                        int numThreads) {
+  assert(object.channels() == 1);
+  if (reference.channels() != 1 && reference.channels() != 3) {
+    throw "Wrong number of channels";
+  }
+
+  // Covariances are shift invariant, so centring only changes rounding.
+  cv::Scalar objectMean = cv::mean(object);
+  cv::Scalar referenceMean = cv::mean(reference);
+  float objectOffset = static_cast<float>(objectMean[0]);
+  float referenceOffset[3];
+  for (int c=0; c<3; c++) {
+    referenceOffset[c] = static_cast<float>(referenceMean[c]);
+  }
+
+  // rows are written as they are done, so only an output that does not
+  // share the inputs' data is written directly
+  cv::Mat image;
+  const bool direct = output && output->data != object.data &&
+                      output->data != reference.data;
+  cv::Mat &result = direct ? *output : image;
+  result.create(object.rows, object.cols, object.depth());
+  ParallelForRows(object.rows, numThreads, [&](int begin, int end) {
+    if (reference.channels() == 3) {
+      FilterBand<3>(object, reference, objectOffset, referenceOffset,
+                    windowSize, epsilon, begin, end, &result);
+    }
+    else {
+      FilterBand<1>(object, reference, objectOffset, referenceOffset,
+                    windowSize, epsilon, begin, end, &result);
+    }
+  });
+  if (output && !direct) {
+    image.copyTo(*output);
+  }
+  return result;
+}
+
+}  // namespace gdfmm
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+
+namespace gdfmm {
+
+/** \brief Guided filter on single-precision running box sums.
+ *
+ * Same filter as GuidedFilter, for 1- or 3-channel references, but the
+ * window sums come from a sliding column accumulator instead of
+ * double-precision integral images. Each band of output rows keeps only
+ * its column sums and a ring of 2 * (windowSize / 2) + 2 rows of A/B
+ * coefficients, so temporaries scale with the width of the image, not its
+ * area. Inputs are centred on their global mean before accumulation, which
+ * keeps the float variances well conditioned.
+ *
+ * The running sums are recomputed from scratch every 64 rows and
+ * columns, so their rounding error does not build up over the frame.
+ *
+ * Accuracy: on the synthetic frames of test_box_guided_filter in
+ * src/test.cc (16-bit sloped depth, noisy 8-bit references), with windows
+ * of 3, 7 and 15 and epsilon of 10 and 100, the output differs from the
+ * integral-image engine by less than 0.015 at 200x150 and less than 0.03
+ * at 1920x1080 in a single band. The largest differences are at small
+ * windows and epsilon.
+ * Integer outputs are rounded rather than truncated.
+ *
+ * Rows are written straight into `output`, which is reallocated only if
+ * its size or depth differs from `object`. Only when `output` shares data
+ * with the inputs is the result computed separately and then copied.
+ * */
+cv::Mat BoxGuidedFilter(const cv::Mat &object,
+                        const cv::Mat &reference,
+                        cv::Mat *output,
+                        int windowSize,
+                        float epsilon,
+                        int numThreads);
+
+}  // namespace gdfmm
@@ -4,20 +4,22 @@
 namespace gdfmm {
 
 GDFMM::ExpCache::ExpCache(float sigma, int tableSize)
-: lookupTable(new float[tableSize + 1]),
+: lookupTable(new float[2 * tableSize + 1]),
   tableSize_(tableSize) {
 
-  lookupTable[0] = 1;
+  // symmetric table, so that lookups need no abs()
+  float *center = lookupTable.get() + tableSize;
+  center[0] = 1;
   for (int i=1; i<= tableSize; i++) {
-    lookupTable[i] = expf( - 0.5 * (i / sigma) * (i / sigma) );
+    center[i] = expf( - 0.5 * (i / sigma) * (i / sigma) );
+    center[-i] = center[i];
   }
 }
 
-float GDFMM::ExpCache::operator()(int d) {
-  d = abs(d);
-  assert(d <= tableSize_);
+float GDFMM::ExpCache::operator()(int d) const {
+  assert(abs(d) <= tableSize_);
 
-  return lookupTable[d];
+  return Centered()[d];
 }
 
 }
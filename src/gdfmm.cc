@@ -1,5 +1,17 @@
 // Copyright 2015 ETH Zurich. All rights reserved
 #include "gdfmm/gdfmm.h"
+#ifdef GDFMM_HAVE_OPENCL
+#include "gdfmm/umat.h"
+#endif
+#include "gdfmm_internals.h"
+#include "hole_groups.h"
+#include "narrow_band.h"
+#include "parallel.h"
+#include "speed_map.h"
+#include "stats.h"
+#include "window_kernel.h"
+#include "window_statistics.h"
+#include "workspace.h"
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -8,10 +20,12 @@
 #include <set>
 #include <queue>
 #include <algorithm>
+#include <limits>
 #include <utility>
 #include <iostream>
 #include <cassert>
-#include <eigen3/Eigen/Eigen>
+#include <cmath>
+#include <mutex>
 
 #include <cstdio>
 
@@ -21,8 +35,17 @@ namespace gdfmm {
 using std::set;
 using std::pair;
 
-static float ComputeSpeed(const cv::Mat &gradientStrength,
-                          const Point &position);
+// Speeds are in [-1, 0), and pixels that had to wait for known neighbours
+// are pushed 1 below the key of the pixel that reached them (see
+// Propagate). The bucket queue covers that key range.
+static const float kMinBandKey = -2.0f;
+static const float kMaxBandKey = 0.0f;
+static const int kBucketsPerUnit = 256;
+// wavefront steps with fewer pixels are predicted on the calling thread
+static const size_t kMinParallelStep = 64;
+
+// resolved once, from the CPU we are running on
+static const AccumulateRowFn AccumulateRow = SelectAccumulateRow();
 
 GDFMM::GDFMM(float sigmaDistance,
         float sigmaColor,
@@ -31,62 +54,513 @@ GDFMM::GDFMM(float sigmaDistance,
   : distExpCache_(sigmaDistance, windowSize),
     colorExpCache_(sigmaColor, 255),
     windowSize_(windowSize),
-    blurSigma_(blurSigma)
+    blurSigma_(blurSigma),
+    queuePolicy_(kHeapQueue),
+    incrementalRegression_(false),
+    depthGradient_(false),
+    tileSize_(0),
+    tileThreads_(0),
+    holeThreads_(1),
+    outputDepth_(CV_64F),
+    pyramidLevels_(1),
+    deviceSpeedMap_(false),
+    wavefrontDelta_(0),
+    wavefrontThreads_(0)
   {
   assert(windowSize_ % 2 == 1 && windowSize >= 3);
+
+  int windowRadius = windowSize_ / 2;
+  spatialKernel_.reset(new float[windowSize_ * windowSize_]);
+  for (int dy = -windowRadius; dy <= windowRadius; dy++) {
+    for (int dx = -windowRadius; dx <= windowRadius; dx++) {
+      spatialKernel_[(dy + windowRadius) * windowSize_ + dx + windowRadius] =
+          distExpCache_(dx) * distExpCache_(dy);
+    }
+  }
 }
 
+// The smaller of two one-sided differences, 0 if they disagree in sign.
+static float Minmod(float before, float after) {
+  if ((before > 0) != (after > 0)) {
+    return 0;
+  }
+  return std::abs(before) < std::abs(after) ? before : after;
+}
+
+/* The depth gradient at a pixel, per axis the minmod of the differences
+ * to both neighbours, or 0 unless it and both are known. The paper averages
+ * the differences to the known neighbours instead, which lets a depth edge
+ * next to the pixel tilt it by half the edge; extrapolated from, that
+ * spreads through the holes along edges. */
 static pair<float, float> ComputeDepthGradient(
                             const cv::Mat &depthImage,
                             int x, int y) {
-  float dx = 0, dy = 0;
-  int wx = 0, wy = 0;
   assert(depthImage.depth() == CV_32F);
+  const float d = depthImage.at<float>(y,x);
+  float dx = 0, dy = 0;
+  if (d != 0 && x > 0 && x+1 < depthImage.cols) {
+    const float left = depthImage.at<float>(y,x-1);
+    const float right = depthImage.at<float>(y,x+1);
+    if (left != 0 && right != 0) {
+      dx = Minmod(d - left, right - d);
+    }
+  }
+  if (d != 0 && y > 0 && y+1 < depthImage.rows) {
+    const float up = depthImage.at<float>(y-1,x);
+    const float down = depthImage.at<float>(y+1,x);
+    if (up != 0 && down != 0) {
+      dy = Minmod(d - up, down - d);
+    }
+  }
+  return std::make_pair(dx, dy);
+}
+
+
+void GDFMM::SetQueuePolicy(QueuePolicy policy) {
+  queuePolicy_ = policy;
+}
+
+void GDFMM::SetIncrementalRegression(bool enabled) {
+  incrementalRegression_ = enabled;
+}
+
+void GDFMM::SetDepthGradient(bool enabled) {
+  depthGradient_ = enabled;
+}
+
+int GDFMM::OutputDepth(const cv::Mat &depthImage) const {
+  return outputDepth_ < 0 ? depthImage.depth() : outputDepth_;
+}
 
-  if (x > 0 && depthImage.at<float>(y,x) != 0
-            && depthImage.at<float>(y,x-1) != 0) {
-    dx += depthImage.at<float>(y,x) - depthImage.at<float>(y,x-1);
-    wx++;
+void GDFMM::SetOutputDepth(int depth) {
+  CHECK(depth < 0 || depth == CV_8U || depth == CV_16U ||
+        depth == CV_32F || depth == CV_64F);
+  outputDepth_ = depth;
+}
+
+void GDFMM::SetPyramidLevels(int levels) {
+  CHECK(levels >= 1);
+  pyramidLevels_ = levels;
+}
+
+void GDFMM::SetDeviceSpeedMap(bool enabled) {
+#ifndef GDFMM_HAVE_OPENCL
+  if (enabled) {
+    throw std::runtime_error("GDFMM was built without GDFMM_OPENCL");
   }
-  if (x+1 < depthImage.cols
-            && depthImage.at<float>(y,x+1) != 0
-            && depthImage.at<float>(y,x) != 0) {
-    dx += depthImage.at<float>(y,x+1) - depthImage.at<float>(y,x);
-    wx++;
+#endif
+  deviceSpeedMap_ = enabled;
+}
+
+void GDFMM::SetWavefront(float delta, int numThreads) {
+  CHECK(delta >= 0);
+  wavefrontDelta_ = delta;
+  wavefrontThreads_ = numThreads;
+}
+
+void GDFMM::SetHoleParallelism(int numThreads) {
+  holeThreads_ = numThreads;
+}
+
+void GDFMM::SetTiling(int tileSize, int numThreads) {
+  CHECK(tileSize == 0 || tileSize > static_cast<int>(windowSize_));
+  tileSize_ = tileSize;
+  tileThreads_ = numThreads;
+}
+
+/* Predictors passed to InPaintBase provide
+ *   Init(depth, rgb, buffers)    called once, before the march
+ *   operator()(depth, rgb, x, y, knownCount)
+ *                                the prediction, 0 if it is not possible; sets
+ *                                *knownCount in GDFMM_STATS builds
+ *   Filled(rgb, x, y, depth)     called whenever a pixel is filled
+ * */
+
+// Adapts a stateless prediction function.
+template <class F>
+class FunctionPredictor {
+  public:
+  explicit FunctionPredictor(F predict) : predict_(predict) {}
+  void Init(const cv::Mat &, const cv::Mat &, Workspace::Buffers *) {}
+  float operator()(const cv::Mat &depthImage, const cv::Mat &rgbImage,
+                   int x, int y, int *knownCount) {
+    return predict_(depthImage, rgbImage, x, y, knownCount);
   }
+  void Filled(const cv::Mat &, int, int, float) {}
+
+  private:
+  F predict_;
+};
+
+template <class F>
+static FunctionPredictor<F> MakePredictor(F predict) {
+  return FunctionPredictor<F>(predict);
+}
+
+// Caches ComputeDepthGradient of (x, y) in `gradient`.
+static inline void UpdateDepthGradient(const cv::Mat &depthImage,
+                                       int x, int y, cv::Mat *gradient) {
+  pair<float, float> g = ComputeDepthGradient(depthImage, x, y);
+  cv::Vec2f &cached = gradient->at<cv::Vec2f>(y, x);
+  cached[0] = g.first;
+  cached[1] = g.second;
+}
 
-  if (y > 0 && depthImage.at<float>(y,x) != 0
-            && depthImage.at<float>(y-1,x) != 0) {
-    dy += depthImage.at<float>(y,x) - depthImage.at<float>(y-1,x);
-    wy++;
+// Adapts a prediction function that also reads the depth gradient of
+// every pixel, kept in a CV_32FC2 image as the march fills pixels.
+template <class F>
+class GradientPredictor {
+  public:
+  explicit GradientPredictor(F predict)
+    : depthImage_(nullptr), gradient_(nullptr), predict_(predict) {}
+  void Init(const cv::Mat &depthImage, const cv::Mat &,
+            Workspace::Buffers *buffers) {
+    depthImage_ = &depthImage;
+    gradient_ = &buffers->depthGradient;
+    gradient_->create(depthImage.rows, depthImage.cols, CV_32FC2);
+    for (int y = 0; y < depthImage.rows; y++) {
+      for (int x = 0; x < depthImage.cols; x++) {
+        UpdateDepthGradient(depthImage, x, y, gradient_);
+      }
+    }
   }
-  if (y+1 < depthImage.rows
-            && depthImage.at<float>(y+1,x) != 0
-            && depthImage.at<float>(y,x) != 0) {
-    dy += depthImage.at<float>(y+1,x) - depthImage.at<float>(y,x);
-    wy++;
+  float operator()(const cv::Mat &depthImage, const cv::Mat &rgbImage,
+                   int x, int y, int *knownCount) {
+    return predict_(depthImage, *gradient_, rgbImage, x, y, knownCount);
   }
+  void Filled(const cv::Mat &, int x, int y, float) {
+    // only the differences at (x, y) and its 4-neighbours change
+    const cv::Mat &depthImage = *depthImage_;
+    UpdateDepthGradient(depthImage, x, y, gradient_);
+    if (x > 0) {
+      UpdateDepthGradient(depthImage, x - 1, y, gradient_);
+    }
+    if (x + 1 < depthImage.cols) {
+      UpdateDepthGradient(depthImage, x + 1, y, gradient_);
+    }
+    if (y > 0) {
+      UpdateDepthGradient(depthImage, x, y - 1, gradient_);
+    }
+    if (y + 1 < depthImage.rows) {
+      UpdateDepthGradient(depthImage, x, y + 1, gradient_);
+    }
+  }
+
+  private:
+  const cv::Mat *depthImage_;
+  cv::Mat *gradient_;
+  F predict_;
+};
 
-//  depthGradientX->at<float>(y,x) = (wx > 0) ? dx / wx : 0;
-//  depthGradientY->at<float>(y,x) = (wy > 0) ? dy / wy : 0;
-  return std::make_pair(
-      (wx > 0) ? dx / wx : 0,
-      (wy > 0) ? dy / wy : 0
-      );
+template <class F>
+static GradientPredictor<F> MakeGradientPredictor(F predict) {
+  return GradientPredictor<F>(predict);
 }
 
+// PredictDepth2 from running window statistics.
+class IncrementalPredictor {
+  public:
+  IncrementalPredictor(int windowSize, float epsilon, float constant)
+    : statistics_(nullptr), windowSize_(windowSize),
+      epsilon_(epsilon), constant_(constant) {}
+  void Init(const cv::Mat &depthImage, const cv::Mat &rgbImage,
+            Workspace::Buffers *buffers) {
+    statistics_ = &buffers->statistics;
+    statistics_->Init(depthImage, rgbImage, windowSize_);
+  }
+  float operator()(const cv::Mat &, const cv::Mat &rgbImage, int x, int y,
+                   int *knownCount) {
+    GDFMM_STATS_ONLY(*knownCount = statistics_->Count(x, y);)
+    return statistics_->Predict(rgbImage, x, y, epsilon_, constant_);
+  }
+  void Filled(const cv::Mat &rgbImage, int x, int y, float depth) {
+    statistics_->Add(rgbImage, x, y, depth);
+  }
+
+  private:
+  WindowStatistics *statistics_;
+  int windowSize_;
+  float epsilon_, constant_;
+};
 
 cv::Mat GDFMM::InPaint(const cv::Mat &depthImage,
                       const cv::Mat &rgbImageOriginal,
-                      cv::Mat *output) {
-  return InPaintBase(depthImage,
-                      rgbImageOriginal,
-                      output,
+                      cv::Mat *output,
+                      Workspace *workspace) const {
+  return InPaintTo(depthImage, rgbImageOriginal, output,
+                   OutputDepth(depthImage), workspace);
+}
+
+cv::Mat GDFMM::InPaint(const cv::Mat &depthImage,
+                       const cv::Mat &rgbImage,
+                       const cv::Rect &roi,
+                       const cv::Mat &mask,
+                       cv::Mat *output,
+                       Workspace *workspace) const {
+  const cv::Rect frame(0, 0, depthImage.cols, depthImage.rows);
+  if (roi.area() == 0 || (roi & frame) != roi) {
+    throw std::runtime_error("ROI must be a non-empty part of the image.");
+  }
+  CHECK(mask.empty() || (mask.type() == CV_8U && mask.size() == roi.size()));
+  std::unique_ptr<Workspace> localWorkspace;
+  if (!workspace) {
+    localWorkspace.reset(new Workspace);
+    workspace = localWorkspace.get();
+  }
+  Workspace::Buffers &buffers = *workspace->buffers();
+
+  // the ROI and the apron its predictions read
+  const int apron = windowSize_ / 2;
+  cv::Rect region(roi.x - apron, roi.y - apron,
+                  roi.width + 2 * apron, roi.height + 2 * apron);
+  region &= frame;
+  const cv::Rect inner(roi.x - region.x, roi.y - region.y,
+                       roi.width, roi.height);
+
+  // the target is only set for this call; its buffer is kept
+  struct TargetScope {
+    cv::Mat *target;
+    ~TargetScope() { *target = cv::Mat(); }
+  } scope = {&buffers.target};
+  buffers.regionTarget.create(region.height, region.width, CV_8U);
+  buffers.regionTarget.setTo(cv::Scalar(0));
+  buffers.target = buffers.regionTarget;
+  cv::Mat innerTarget = buffers.target(inner);
+  if (mask.empty()) {
+    innerTarget.setTo(cv::Scalar(255));
+  }
+  else {
+    mask.copyTo(innerTarget);
+  }
+
+  // the inpainted region stays in the CV_32F workspace buffer
+  InPaintTo(depthImage(region), rgbImage(region), nullptr, -1, workspace);
+  const cv::Mat filled = buffers.depth(inner);
+  if (output) {
+    filled.convertTo(*output, OutputDepth(depthImage));
+    return *output;
+  }
+  else {
+    cv::Mat result;
+    filled.convertTo(result, OutputDepth(depthImage));
+    return result;
+  }
+}
+
+cv::Mat GDFMM::InPaintTo(const cv::Mat &depthImage,
+                         const cv::Mat &rgbImageOriginal,
+                         cv::Mat *output,
+                         int outputDepth,
+                         Workspace *workspace) const {
+  CHECK(rgbImageOriginal.depth() == CV_8U);
+  CHECK(rgbImageOriginal.channels() == 1 || rgbImageOriginal.channels() == 3);
+  bool color = rgbImageOriginal.channels() == 3;
+  // common window sizes get window rows of compile-time length
+  switch (windowSize_) {
+    case 5:
+      return color ? InPaintFixed<5, 3>(depthImage, rgbImageOriginal, output, outputDepth, workspace)
+                   : InPaintFixed<5, 1>(depthImage, rgbImageOriginal, output, outputDepth, workspace);
+    case 7:
+      return color ? InPaintFixed<7, 3>(depthImage, rgbImageOriginal, output, outputDepth, workspace)
+                   : InPaintFixed<7, 1>(depthImage, rgbImageOriginal, output, outputDepth, workspace);
+    case 11:
+      return color ? InPaintFixed<11, 3>(depthImage, rgbImageOriginal, output, outputDepth, workspace)
+                   : InPaintFixed<11, 1>(depthImage, rgbImageOriginal, output, outputDepth, workspace);
+    default:
+      return color ? InPaintFixed<0, 3>(depthImage, rgbImageOriginal, output, outputDepth, workspace)
+                   : InPaintFixed<0, 1>(depthImage, rgbImageOriginal, output, outputDepth, workspace);
+  }
+}
+
+template <int kWindowSize, int kChannels>
+cv::Mat GDFMM::InPaintFixed(const cv::Mat &depthImage,
+                            const cv::Mat &rgbImage,
+                            cv::Mat *output,
+                            int outputDepth,
+                            Workspace *workspace) const {
+  if (depthGradient_) {
+    auto predictor = MakeGradientPredictor(
+                        [this] (const cv::Mat &dI,
+                            const cv::Mat &gI,
+                            const cv::Mat &rgbI,
+                            int x, int y, int *known) {
+                          return PredictDepthGradient<kChannels>(
+                              dI, gI, rgbI, x, y, known);
+                        });
+    return InPaintBase(depthImage, rgbImage, output, outputDepth, workspace,
+                       &predictor);
+  }
+  auto predictor = MakePredictor(
                       [this] (const cv::Mat &dI,
                           const cv::Mat &rgbI,
-                          int x, int y) {
-                        return PredictDepth(dI, rgbI, x, y);
+                          int x, int y, int *known) {
+                        return PredictDepth<kWindowSize, kChannels>(
+                            dI, rgbI, x, y, known);
                       });
+  return InPaintBase(depthImage,
+                      rgbImage,
+                      output,
+                      outputDepth,
+                      workspace,
+                      &predictor);
+}
+
+cv::Mat GDFMM::Enhance(const cv::Mat &depthImage,
+                       const cv::Mat &rgbImage,
+                       int filterWindowSize,
+                       float filterEpsilon,
+                       cv::Mat *output,
+                       Workspace *workspace) const {
+  std::unique_ptr<Workspace> localWorkspace;
+  if (!workspace) {
+    localWorkspace.reset(new Workspace);
+    workspace = localWorkspace.get();
+  }
+
+  // the inpainted depth stays in the CV_32F workspace buffer
+  InPaintTo(depthImage, rgbImage, nullptr, -1, workspace);
+  return FilterInPainted(depthImage, rgbImage, filterWindowSize,
+                         filterEpsilon, output, workspace);
+}
+
+cv::Mat GDFMM::FilterInPainted(const cv::Mat &depthImage,
+                               const cv::Mat &rgbImage,
+                               int filterWindowSize,
+                               float filterEpsilon,
+                               cv::Mat *output,
+                               Workspace *workspace) const {
+  Workspace::Buffers &buffers = *workspace->buffers();
+  GuidedFilterOptions options;
+  options.workspace = workspace;
+  int outputDepth = OutputDepth(depthImage);
+  if (outputDepth == CV_32F) {
+    return GuidedFilter(buffers.depth, rgbImage, output,
+                        filterWindowSize, filterEpsilon, options);
+  }
+  GuidedFilter(buffers.depth, rgbImage, &buffers.filtered,
+               filterWindowSize, filterEpsilon, options);
+  if (output) {
+    buffers.filtered.convertTo(*output, outputDepth);
+    return *output;
+  }
+  else {
+    cv::Mat result;
+    buffers.filtered.convertTo(result, outputDepth);
+    return result;
+  }
+}
+
+std::vector<cv::Mat> GDFMM::InPaintBatch(
+    const std::vector<cv::Mat> &depthImages,
+    const std::vector<cv::Mat> &rgbImages,
+    int numThreads) const {
+  if (depthImages.size() != rgbImages.size()) {
+    throw std::runtime_error("Batches must have the same number of frames.");
+  }
+  std::vector<cv::Mat> results(depthImages.size());
+  // one band of frames per worker, each with its own buffers
+  ParallelForRows(static_cast<int>(depthImages.size()), numThreads,
+                  [&](int begin, int end) {
+    Workspace workspace;
+    for (int i=begin; i<end; i++) {
+      InPaint(depthImages[i], rgbImages[i], &results[i], &workspace);
+    }
+  });
+  return results;
+}
+
+InPaintSession::InPaintSession(float colorThreshold, float depthThreshold)
+  : colorThreshold_(colorThreshold),
+    depthThreshold_(depthThreshold),
+    reusedPixels_(0) {}
+
+void InPaintSession::Reset() {
+  depth_.release();
+  rgb_.release();
+  filled_.release();
+  reusedPixels_ = 0;
+}
+
+// Marks pixels whose color or depth changed between frames with 1.
+static void ChangedPixels(const cv::Mat &depth, const cv::Mat &previousDepth,
+                          const cv::Mat &rgb, const cv::Mat &previousRgb,
+                          float colorThreshold, float depthThreshold,
+                          cv::Mat *changed) {
+  const int channels = rgb.channels();
+  changed->create(depth.rows, depth.cols, CV_8U);
+  for (int y=0; y<depth.rows; y++) {
+    const float *d = depth.ptr<float>(y), *pd = previousDepth.ptr<float>(y);
+    const uint8_t *c = rgb.ptr<uint8_t>(y), *pc = previousRgb.ptr<uint8_t>(y);
+    uint8_t *out = changed->ptr<uint8_t>(y);
+    for (int x=0; x<depth.cols; x++) {
+      bool moved = (d[x] == 0) != (pd[x] == 0) ||
+                   std::abs(d[x] - pd[x]) > depthThreshold;
+      for (int k=0; k<channels; k++) {
+        moved = moved ||
+            std::abs(c[x * channels + k] - pc[x * channels + k]) > colorThreshold;
+      }
+      out[x] = moved;
+    }
+  }
+}
+
+cv::Mat GDFMM::InPaintStream(const cv::Mat &depthImage,
+                             const cv::Mat &rgbImage,
+                             InPaintSession *session,
+                             cv::Mat *output) const {
+  CHECK(session);
+  CHECK(depthImage.channels() == 1);
+  CHECK(rgbImage.depth() == CV_8U);
+  cv::Mat &seed = session->seed_;
+  depthImage.convertTo(seed, CV_32F);
+
+  session->reusedPixels_ = 0;
+  bool warm = !session->filled_.empty() &&
+              session->depth_.size() == seed.size() &&
+              session->rgb_.size() == rgbImage.size() &&
+              session->rgb_.type() == rgbImage.type();
+  if (warm) {
+    // a missing pixel may reuse its previous depth if nothing changed in
+    // its window
+    cv::Mat &changedI = session->changedI_;
+    ChangedPixels(seed, session->depth_, rgbImage, session->rgb_,
+                  session->colorThreshold_, session->depthThreshold_,
+                  &session->changed_);
+    cv::integral(session->changed_, changedI, CV_32S);
+    seed.copyTo(session->depth_);
+
+    int windowRadius = windowSize_ / 2;
+    for (int y=0; y<seed.rows; y++) {
+      float *d = seed.ptr<float>(y);
+      const float *previous = session->filled_.ptr<float>(y);
+      int top = std::max(0, y - windowRadius);
+      int bottom = std::min(seed.rows, y + windowRadius + 1);
+      for (int x=0; x<seed.cols; x++) {
+        if (d[x] != 0 || previous[x] == 0)
+          continue;
+        int left = std::max(0, x - windowRadius);
+        int right = std::min(seed.cols, x + windowRadius + 1);
+        int count = changedI.at<int>(bottom, right)
+                  - changedI.at<int>(top, right)
+                  - changedI.at<int>(bottom, left)
+                  + changedI.at<int>(top, left);
+        if (count == 0) {
+          d[x] = previous[x];
+          session->reusedPixels_++;
+        }
+      }
+    }
+  }
+  else {
+    seed.copyTo(session->depth_);
+  }
+  rgbImage.copyTo(session->rgb_);
+
+  // the result has the type InPaint gives the input depth
+  cv::Mat result = InPaintTo(seed, rgbImage, output, OutputDepth(depthImage),
+                             &session->workspace_);
+  session->workspace_.buffers()->depth.copyTo(session->filled_);
+  return result;
 }
 
 cv::Mat GDFMM::InPaint2(const cv::Mat &depthImage,
@@ -94,164 +568,689 @@ cv::Mat GDFMM::InPaint2(const cv::Mat &depthImage,
                       float epsilon,
                       float constant,
                       float truncation,
-                      cv::Mat *output) {
-  return InPaintBase(depthImage,
-                      rgbImageOriginal,
-                      output,
+                      cv::Mat *output,
+                      Workspace *workspace) const {
+  CHECK(rgbImageOriginal.channels() == 3);
+  if (incrementalRegression_) {
+    IncrementalPredictor predictor(windowSize_, epsilon, constant);
+    return InPaintBase(depthImage, rgbImageOriginal, output,
+                       OutputDepth(depthImage), workspace, &predictor);
+  }
+  auto predictor = MakePredictor(
                       [this, epsilon, constant, truncation]
                       (const cv::Mat &dI,
                        const cv::Mat &rgbI,
-                             int x, int y) {
+                             int x, int y, int *known) {
                         return PredictDepth2(dI, rgbI,
                                              x, y,
                                              epsilon, constant,
-                                             truncation);
+                                             truncation, known);
                       });
+  return InPaintBase(depthImage,
+                      rgbImageOriginal,
+                      output,
+                      OutputDepth(depthImage),
+                      workspace,
+                      &predictor);
 }
 
-template <class PredictMethod>
-cv::Mat GDFMM::InPaintBase(const cv::Mat &depthImageOriginal,
-                const cv::Mat &rgbImage,
-                cv::Mat *output,
-                const PredictMethod &predict) {
-  if (rgbImage.cols != depthImageOriginal.cols ||
-      rgbImage.rows != depthImageOriginal.rows) {
-    throw std::runtime_error("Images must have same size.");
+// CV_32S integral image of the known pixels of `depthImage`.
+static void KnownIntegral(const cv::Mat &depthImage, cv::Mat *knownI) {
+  knownI->create(depthImage.rows + 1, depthImage.cols + 1, CV_32S);
+  std::fill(knownI->ptr<int>(0), knownI->ptr<int>(0) + knownI->cols, 0);
+  for (int y=0; y<depthImage.rows; y++) {
+    const float *d = depthImage.ptr<float>(y);
+    const int *above = knownI->ptr<int>(y);
+    int *out = knownI->ptr<int>(y + 1);
+    int rowSum = 0;
+    out[0] = 0;
+    for (int x=0; x<depthImage.cols; x++) {
+      rowSum += d[x] != 0;
+      out[x + 1] = above[x + 1] + rowSum;
+    }
   }
-  cv::Mat depthImage;
+}
 
-  CHECK(depthImageOriginal.channels() == 1);
-  CHECK(rgbImage.channels() == 3);
-  //cv::Mat result(depthImageOriginal.rows, depthImageOriginal.cols,
-  //                CV_32F);
+// Known pixels in the window of (x, y), from KnownIntegral.
+static inline int KnownInWindow(const cv::Mat &knownI, int windowRadius,
+                                int x, int y) {
+  const int *top = knownI.ptr<int>(std::max(0, y - windowRadius));
+  const int *bottom = knownI.ptr<int>(std::min(knownI.rows - 1, y + windowRadius + 1));
+  int left = std::max(0, x - windowRadius);
+  int right = std::min(knownI.cols - 1, x + windowRadius + 1);
+  return bottom[right] - top[right] - bottom[left] + top[left];
+}
 
-  // depth gradient
-//  cv::Mat depthGradientX(depthImageOriginal.rows, depthImageOriginal.cols, CV_32F);
-//  cv::Mat depthGradientY(depthImageOriginal.rows, depthImageOriginal.cols, CV_32F);
+// How Propagate orders the march (see GDFMM::SetQueuePolicy and
+// GDFMM::SetWavefront).
+struct MarchOrder {
+  GDFMM::QueuePolicy policy;
+  float delta;
+  int numThreads;
+};
 
-  // Cannot use Sobel, because depth is sometimes unknown
-  depthImageOriginal.convertTo(depthImage, CV_32F);
-// ComputeDepthGradients(depthImage, &depthGradientX, &depthGradientY);
+/* Scheduling states of pixels, in Propagate's `state` image; other values
+ * are the key of the pixel that reached a waiting pixel. */
+static const float kIdle = 1.0f;
+static const float kScheduled = 2.0f;
+static const float kGivenUp = 3.0f;
+static const float kKnown = 4.0f;
+// missing pixels outside the target of GDFMM::InPaint with a region
+static const float kExcluded = 5.0f;
 
-  // gradient image, then (Gaussian blur)
-  // resize rgb to depth image (specifically for Tango device)
-  cv::Mat rgbGradientX(rgbImage.rows, rgbImage.cols, CV_32FC3);
-  cv::Mat rgbGradientY(rgbImage.rows, rgbImage.cols, CV_32FC3);
-  cv::Mat tmp;
-
-  cv::GaussianBlur(rgbImage, tmp, cv::Size(0,0), blurSigma_, blurSigma_);
-  cv::Sobel(tmp, rgbGradientX, CV_32F, 1, 0, 3);
-  cv::Sobel(tmp, rgbGradientY, CV_32F, 0, 1, 3);
-
-  cv::Mat rgbGradientStrength(rgbImage.rows, rgbImage.cols, CV_32FC3);
-
-  for (int y=0; y<rgbImage.rows; y++) {
-    for (int x=0; x<rgbImage.cols; x++) {
-      for (int c=0; c<3; c++) {
-        rgbGradientStrength.at<cv::Vec3f>(y, x)[c] =
-            rgbGradientX.at<cv::Vec3f>(y, x)[c] * rgbGradientX.at<cv::Vec3f>(y, x)[c] +
-            rgbGradientY.at<cv::Vec3f>(y, x)[c] * rgbGradientY.at<cv::Vec3f>(y, x)[c];
+/* The march. Known pixels are popped in order of their key and predict
+ * their missing 4-neighbours. The predictions need more than 3 known
+ * pixels in the window (PredictDepth, PredictDepth2 and
+ * WindowStatistics return 0 otherwise), so the known count of every
+ * pixel's window is kept up to date as pixels are filled. A neighbour
+ * with too few known pixels waits instead of being predicted; once its
+ * count is high enough it is pushed itself, one below the key of the
+ * pixel that reached it, and predicted when it is popped. Every missing
+ * pixel is thus predicted at most once. If buffers->target is not empty,
+ * only the missing pixels where it is non-zero are filled, and the march
+ * does not pass through the others.
+ *
+ * Band entries are linear indices into the state image, whose 1-pixel
+ * border is marked known so that neighbours need no bounds checks.
+ *
+ * With a wavefront (order.delta > 0), all entries within delta of the top
+ * key are popped at once, the missing pixels they reach are predicted in
+ * parallel from the depths known before the batch, and the results are
+ * then filled in pop order. */
+template <class Band, class PredictMethod>
+static void Propagate(Band *narrowBandPtr,
+                      cv::Mat *depthImagePtr,
+                      const cv::Mat &rgbImage,
+                      const cv::Mat &speedMap,
+                      int windowRadius,
+                      const MarchOrder &order,
+                      Workspace::Buffers *buffers,
+                      PredictMethod *predict,
+                      Stats *stats) {
+  Band &narrowBand = *narrowBandPtr;
+  cv::Mat &depthImage = *depthImagePtr;
+  const int rows = depthImage.rows, cols = depthImage.cols;
+  const int stride = cols + 2;
+  CHECK(static_cast<double>(rows + 2) * stride <= UINT32_MAX);
+
+  cv::Mat &knownCount = buffers->knownCount;
+  KnownIntegral(depthImage, &buffers->knownI);
+  knownCount.create(rows, cols, CV_32S);
+  buffers->state.create(rows + 2, stride, CV_32F);
+  CHECK(buffers->state.isContinuous());
+  float *state = buffers->state.ptr<float>(0);
+  std::fill(state, state + stride, kKnown);
+  std::fill(state + (rows + 1) * stride, state + (rows + 2) * stride, kKnown);
+  const cv::Mat &target = buffers->target;
+  for (int y=0; y<rows; y++) {
+    const float *d = depthImage.ptr<float>(y);
+    const uint8_t *t = target.empty() ? nullptr : target.ptr<uint8_t>(y);
+    int *count = knownCount.ptr<int>(y);
+    float *row = state + (y + 1) * stride;
+    row[0] = row[cols + 1] = kKnown;
+    for (int x=0; x<cols; x++) {
+      count[x] = KnownInWindow(buffers->knownI, windowRadius, x, y);
+      row[x + 1] = d[x] != 0 ? kKnown : (t && !t[x] ? kExcluded : kIdle);
+    }
+  }
+  int waitingPixels = 0;
+
+  // initialize narrowBand with the known pixels on the hole boundaries;
+  // the others would be popped without a missing neighbour
+  for (int y=0; y<rows; y++) {
+    for (int x=0; x<cols; x++) {
+      uint32_t i = (y + 1) * stride + x + 1;
+      if (state[i] == kKnown &&
+          (state[i - stride] == kIdle || state[i + stride] == kIdle ||
+           state[i - 1] == kIdle || state[i + 1] == kIdle)) {
+        narrowBand.emplace(0, i);
+        GDFMM_STATS_ONLY(stats->pushes++;)
       }
     }
   }
-  // Debug ComputeSpeed
-//  {
-//  cv::Mat rescaled(rgbImage.rows, rgbImage.cols, CV_32FC1);
-//  for (int y=0; y<rgbImage.rows; y++) {
-//    for (int x=0; x<rgbImage.cols; x++) {
-//      rescaled.at<float>(y,x) = -ComputeSpeed(rgbGradientStrength, Point{x,y});
-//    }
-//  }
-//  cv::imshow("what", rescaled);
-//  cv::waitKey(0);
-//  }
 
+  // makes the missing pixel i known with depth `prediction`, if not 0
+  auto commit = [&](uint32_t i, float prediction) {
+    const int x = i % stride - 1, y = i / stride - 1;
+    if (prediction == 0) {
+      state[i] = kGivenUp;
+      return;
+    }
+    depthImage.at<float>(y, x) = prediction;
+    state[i] = kKnown;
+    predict->Filled(rgbImage, x, y, prediction);
+    narrowBand.emplace(speedMap.at<float>(y, x), i);
+    GDFMM_STATS_ONLY(stats->pushes++; stats->filledPixels++;)
 
-  // build the priority queue
-  typedef pair<float, Point> BandItem;
-  auto compare = [](const BandItem &p1, const BandItem &p2) -> bool { return p1.first < p2.first; };
-  std::priority_queue<BandItem, std::vector<BandItem>, decltype(compare)>
-          narrowBand(compare);
+    // one more known pixel in every window around (x, y)
+    for (int n=std::max(0, y - windowRadius);
+         n<=std::min(rows - 1, y + windowRadius); n++) {
+      int *count = knownCount.ptr<int>(n);
+      int lower = std::max(0, x - windowRadius);
+      int upper = std::min(cols - 1, x + windowRadius);
+      for (int m=lower; m<=upper; m++) {
+        count[m]++;
+      }
+      if (waitingPixels == 0)
+        continue;
+      float *row = state + (n + 1) * stride + 1;
+      for (int m=lower; m<=upper; m++) {
+        if (count[m] == 4 && row[m] <= 0) {
+          narrowBand.emplace(row[m] - 1, (n + 1) * stride + m + 1);
+          GDFMM_STATS_ONLY(stats->pushes++;)
+          row[m] = kScheduled;
+          waitingPixels--;
+        }
+      }
+    }
+  };
 
-  // initialize narrowBand
-  for (int y=0; y<depthImage.rows; y++) {
-    for (int x=0; x<depthImage.cols; x++) {
-      if (depthImage.at<float>(y, x) != 0) {
-        narrowBand.emplace(0, Point{x, y});
+  // predicts the missing pixel i, and on success makes it known
+  auto fill = [&](uint32_t i) {
+    int knownPixels = 0;
+    GDFMM_STATS_ONLY(StatsClock::time_point start = StatsClock::now();)
+    float prediction = (*predict)(depthImage, rgbImage, i % stride - 1,
+                                  i / stride - 1, &knownPixels);
+    GDFMM_STATS_ONLY(
+      stats->predictSeconds += SecondsSince(start);
+      stats->predictions++;
+      stats->knownCount += knownPixels;
+    )
+    commit(i, prediction);
+  };
+
+  const int neighbours[] {stride, 1, -1, -stride};
+  if (order.delta > 0) {
+    std::vector<uint32_t> &batch = buffers->wavefront;
+    std::vector<float> &predictions = buffers->wavefrontDepths;
+    while (narrowBand.size() > 0) {
+      // the pixels reached by the entries within delta of the top key
+      const float front = BandKey(narrowBand.top()) - order.delta;
+      batch.clear();
+      while (narrowBand.size() > 0 && BandKey(narrowBand.top()) >= front) {
+        BandEntry top = narrowBand.top();
+        narrowBand.pop();
+        GDFMM_STATS_ONLY(stats->pops++;)
+        const uint32_t position = BandIndex(top);
+        if (state[position] == kScheduled) {
+          batch.push_back(position);
+          continue;
+        }
+        for (int d: neighbours) {
+          const uint32_t neighbour = position + d;
+          if (state[neighbour] != kIdle)
+            continue;
+          const int x = neighbour % stride - 1, y = neighbour / stride - 1;
+          if (knownCount.at<int>(y, x) > 3) {
+            state[neighbour] = kScheduled;
+            batch.push_back(neighbour);
+          }
+          else {
+            state[neighbour] = BandKey(top);
+            waitingPixels++;
+            GDFMM_STATS_ONLY(stats->retries++;)
+          }
+        }
+      }
+
+      predictions.resize(batch.size());
+      GDFMM_STATS_ONLY(StatsClock::time_point start = StatsClock::now();)
+      GDFMM_STATS_ONLY(std::mutex statsMutex;)
+      // small steps are not worth waking the workers for
+      const int numThreads =
+          batch.size() < kMinParallelStep ? 1 : order.numThreads;
+      ParallelForRows(static_cast<int>(batch.size()), numThreads,
+                      [&](int begin, int end) {
+        GDFMM_STATS_ONLY(long long knownSum = 0;)
+        for (int k=begin; k<end; k++) {
+          int knownPixels = 0;
+          predictions[k] = (*predict)(depthImage, rgbImage,
+                                      batch[k] % stride - 1,
+                                      batch[k] / stride - 1, &knownPixels);
+          GDFMM_STATS_ONLY(knownSum += knownPixels;)
+        }
+        GDFMM_STATS_ONLY(
+          std::lock_guard<std::mutex> lock(statsMutex);
+          stats->knownCount += knownSum;
+        )
+      });
+      GDFMM_STATS_ONLY(
+        stats->predictSeconds += SecondsSince(start);
+        stats->predictions += batch.size();
+      )
+      for (size_t k=0; k<batch.size(); k++) {
+        commit(batch[k], predictions[k]);
       }
     }
   }
+  else {
+    // propagate, one entry at a time
+    while (narrowBand.size() > 0) {
+      BandEntry top = narrowBand.top();
+      narrowBand.pop();
+      GDFMM_STATS_ONLY(stats->pops++;)
+      const float speed = BandKey(top);
+      const uint32_t position = BandIndex(top);
 
-  // propagate
-  while (narrowBand.size() > 0) {
-    float speed;
-    Point position;
-
-    std::tie(speed, position) = narrowBand.top();
-    narrowBand.pop();
-
-    // use 4-neighbour
-    const Point neighbours[] {
-      {0,1},{1,0},{-1,0},{0,-1}
-    };
-    for (const Point &d: neighbours) {
-      Point neighbour{position.x + d.x, position.y + d.y};
-      if (!(neighbour.x >= 0 &&
-          neighbour.y >= 0 &&
-          neighbour.x < depthImage.cols &&
-          neighbour.y < depthImage.rows))
+      if (state[position] == kScheduled) {
+        // a waiting pixel that can now be predicted
+        fill(position);
         continue;
+      }
 
-      if (depthImage.at<float>(neighbour.y, neighbour.x) == 0) {
-        float prediction =
-              predict(depthImage,
-                      rgbImage,
-                      neighbour.x, neighbour.y);
+      // use 4-neighbour
+      for (int d: neighbours) {
+        const uint32_t neighbour = position + d;
+        if (state[neighbour] != kIdle)
+          continue;
+        const int x = neighbour % stride - 1, y = neighbour / stride - 1;
+        if (knownCount.at<int>(y, x) > 3) {
+          fill(neighbour);
+        }
+        else {
+          // wait until enough of the window is known
+          state[neighbour] = speed;
+          waitingPixels++;
+          GDFMM_STATS_ONLY(stats->retries++;)
+        }
+      }
+    }
+  }
+
+  if (waitingPixels > 0) {
+    throw std::runtime_error("Too few known values. "
+        "Try densifying your depth image first, "
+        "or increasing the window size.");
+  }
+}
+
+// Runs the march over the whole of `depthImage`.
+template <class PredictMethod>
+static void March(const MarchOrder &order,
+                  int windowRadius,
+                  Workspace::Buffers *buffers,
+                  cv::Mat *depthImage,
+                  const cv::Mat &rgbImage,
+                  const cv::Mat &speedMap,
+                  PredictMethod *predict,
+                  Stats *stats) {
+  predict->Init(*depthImage, rgbImage, buffers);
+  if (order.policy == GDFMM::kBucketQueue) {
+    buffers->bucketBand.Reset(kMinBandKey, kMaxBandKey, kBucketsPerUnit);
+    Propagate(&buffers->bucketBand, depthImage, rgbImage, speedMap,
+              windowRadius, order, buffers, predict, stats);
+  }
+  else {
+    buffers->heapBand.Clear();
+    Propagate(&buffers->heapBand, depthImage, rgbImage, speedMap,
+              windowRadius, order, buffers, predict, stats);
+  }
+}
+
+// Grows `workspaces` to at least `count` workspaces; existing ones keep
+// their buffers.
+static void GrowWorkspaces(
+    size_t count, std::vector<std::unique_ptr<Workspace>> *workspaces) {
+  while (workspaces->size() < count) {
+    workspaces->emplace_back(new Workspace);
+  }
+}
+
+/* Marches every tile of `depthImage` independently, on a region grown by
+ * `halo` pixels so that predictions near the tile edges see the known
+ * depths of the neighbouring tiles. Only the pixels of the tile itself are
+ * kept, and of those, missing pixels closer than `halo` to an inner tile
+ * edge are left missing: the serial march afterwards fills them with the
+ * information of both sides. Tiles whose march fails are left alone. */
+template <class PredictMethod>
+static void MarchTiles(const MarchOrder &order,
+                       int tileSize,
+                       int halo,
+                       int numThreads,
+                       Workspace::Buffers *buffers,
+                       cv::Mat *depthImage,
+                       const cv::Mat &rgbImage,
+                       const cv::Mat &speedMap,
+                       const PredictMethod &predict,
+                       Stats *stats) {
+  const int rows = depthImage->rows, cols = depthImage->cols;
+  const int tilesX = (cols + tileSize - 1) / tileSize;
+  const int tilesY = (rows + tileSize - 1) / tileSize;
+  cv::Mat &tiled = buffers->tiled;
+  depthImage->copyTo(tiled);
+  GrowWorkspaces(tilesX * tilesY, &buffers->tileWorkspaces);
+  GDFMM_STATS_ONLY(std::mutex statsMutex;)
 
-        depthImage.at<float>(neighbour.y, neighbour.x) = prediction;
+  ParallelForRows(tilesX * tilesY, numThreads, [&](int begin, int end) {
+    GDFMM_STATS_ONLY(Stats bandStats;)
+    for (int i=begin; i<end; i++) {
+      Workspace::Buffers &tileBuffers = *buffers->tileWorkspaces[i]->buffers();
+      GDFMM_STATS_ONLY(tileBuffers.stats.Clear();)
+      cv::Rect tile((i % tilesX) * tileSize, (i / tilesX) * tileSize,
+                    tileSize, tileSize);
+      tile &= cv::Rect(0, 0, cols, rows);
+      cv::Rect region(tile.x - halo, tile.y - halo,
+                      tile.width + 2 * halo, tile.height + 2 * halo);
+      region &= cv::Rect(0, 0, cols, rows);
 
-        if (prediction != 0) {
-          float T = ComputeSpeed(rgbGradientStrength, neighbour);
-          narrowBand.emplace(T, neighbour);
+      cv::Mat &depth = tileBuffers.depth;
+      (*depthImage)(region).copyTo(depth);
+      tileBuffers.target = buffers->target.empty() ? cv::Mat()
+                                                   : buffers->target(region);
+      PredictMethod tilePredict(predict);
+      try {
+        March(order, halo, &tileBuffers, &depth, rgbImage(region),
+              speedMap(region), &tilePredict, &tileBuffers.stats);
+      }
+      catch (const std::runtime_error &) {
+        GDFMM_STATS_ONLY(AccumulateMarch(tileBuffers.stats, &bandStats);)
+        continue;
+      }
+      GDFMM_STATS_ONLY(AccumulateMarch(tileBuffers.stats, &bandStats);)
+
+      // inner tile edges, within which holes are left to the serial pass
+      int left = tile.x > 0 ? tile.x + halo : 0;
+      int top = tile.y > 0 ? tile.y + halo : 0;
+      int right = tile.x + tile.width < cols ? tile.x + tile.width - halo : cols;
+      int bottom = tile.y + tile.height < rows ? tile.y + tile.height - halo : rows;
+      for (int y=std::max(top, tile.y); y<std::min(bottom, tile.y + tile.height); y++) {
+        const float *filled = depth.ptr<float>(y - region.y);
+        float *out = tiled.ptr<float>(y);
+        for (int x=std::max(left, tile.x); x<std::min(right, tile.x + tile.width); x++) {
+          out[x] = filled[x - region.x];
         }
-        else {
-          // re-try later
-          if (speed < -20) {
-            throw std::runtime_error("Too few known values. "
-                "Try densifying your depth image first, "
-                "or increasing the window size.");
+      }
+    }
+    GDFMM_STATS_ONLY(
+      std::lock_guard<std::mutex> lock(statsMutex);
+      AccumulateMarch(bandStats, stats);
+    )
+  });
+  std::swap(*depthImage, tiled);
+}
+
+/* Marches every group of holes (see HoleGroups) independently over its
+ * bounds, with a target of only the missing pixels of the group. The
+ * groups only read the input depth around them, and only write their own
+ * missing pixels. Groups whose march fails are left to the serial march
+ * afterwards, as in MarchTiles. */
+template <class PredictMethod>
+static void MarchHoles(const MarchOrder &order,
+                       int radius,
+                       int numThreads,
+                       Workspace::Buffers *buffers,
+                       cv::Mat *depthImage,
+                       const cv::Mat &rgbImage,
+                       const cv::Mat &speedMap,
+                       const PredictMethod &predict,
+                       Stats *stats) {
+  HoleGroups &groups = buffers->holes;
+  groups.Find(*depthImage, radius);
+  cv::Mat &filled = buffers->tiled;
+  depthImage->copyTo(filled);
+  GDFMM_STATS_ONLY(std::mutex statsMutex;)
+
+  GrowWorkspaces(RowBands(groups.size(), numThreads),
+                 &buffers->groupWorkspaces);
+  ParallelForBands(groups.size(), numThreads,
+                   [&](int band, int begin, int end) {
+    Workspace::Buffers &groupBuffers =
+        *buffers->groupWorkspaces[band]->buffers();
+    GDFMM_STATS_ONLY(groupBuffers.stats.Clear();)
+    for (int i=begin; i<end; i++) {
+      const cv::Rect &region = groups.Bounds(i);
+      cv::Mat &depth = groupBuffers.depth;
+      (*depthImage)(region).copyTo(depth);
+      // other groups may reach into the bounds; they are not filled here
+      cv::Mat &target = groupBuffers.target;
+      target.create(region.height, region.width, CV_8U);
+      for (int y=0; y<region.height; y++) {
+        const uint8_t *outer = buffers->target.empty() ? nullptr
+            : buffers->target.ptr<uint8_t>(region.y + y) + region.x;
+        uint8_t *t = target.ptr<uint8_t>(y);
+        for (int x=0; x<region.width; x++) {
+          t[x] = groups.Label(region.x + x, region.y + y) == i &&
+                 (!outer || outer[x]);
+        }
+      }
+      PredictMethod groupPredict(predict);
+      try {
+        March(order, radius, &groupBuffers, &depth, rgbImage(region),
+              speedMap(region), &groupPredict, &groupBuffers.stats);
+      }
+      catch (const std::runtime_error &) {
+        continue;
+      }
+
+      for (int y=region.y; y<region.y + region.height; y++) {
+        const float *groupDepth = depth.ptr<float>(y - region.y);
+        float *out = filled.ptr<float>(y);
+        for (int x=region.x; x<region.x + region.width; x++) {
+          if (groups.Label(x, y) == i) {
+            out[x] = groupDepth[x - region.x];
           }
-          narrowBand.emplace(speed - 1, position);
         }
       }
     }
+    GDFMM_STATS_ONLY(
+      std::lock_guard<std::mutex> lock(statsMutex);
+      AccumulateMarch(groupBuffers.stats, stats);
+    )
+  });
+  std::swap(*depthImage, filled);
+}
+
+// Halves a CV_32F depth image, averaging the known pixels of 2x2 blocks.
+static void HalveDepth(const cv::Mat &depthImage, cv::Mat *halved) {
+  halved->create((depthImage.rows + 1) / 2, (depthImage.cols + 1) / 2, CV_32F);
+  for (int y=0; y<halved->rows; y++) {
+    float *out = halved->ptr<float>(y);
+    for (int x=0; x<halved->cols; x++) {
+      float sum = 0;
+      int known = 0;
+      for (int n=2*y; n<std::min(2*y + 2, depthImage.rows); n++) {
+        const float *row = depthImage.ptr<float>(n);
+        for (int m=2*x; m<std::min(2*x + 2, depthImage.cols); m++) {
+          if (row[m] != 0) {
+            sum += row[m];
+            known++;
+          }
+        }
+      }
+      out[x] = known > 0 ? sum / known : 0;
+    }
+  }
+}
+
+template <class PredictMethod>
+void GDFMM::SeedFromCoarser(const cv::Mat &rgbImage,
+                            int levels,
+                            Workspace::Buffers *buffers,
+                            const PredictMethod &predict) const {
+  cv::Mat &depthImage = buffers->depth;
+  if (!buffers->coarser) {
+    buffers->coarser.reset(new Workspace);
+  }
+  Workspace::Buffers &coarser = *buffers->coarser->buffers();
+  coarser.stats.Clear();
+
+  HalveDepth(depthImage, &coarser.depth);
+  cv::resize(rgbImage, buffers->coarserRgb, coarser.depth.size(), 0, 0,
+             cv::INTER_AREA);
+  PredictMethod coarserPredict(predict);
+  MarchLevel(buffers->coarserRgb, levels, false, &coarser, &coarserPredict);
+  cv::resize(coarser.depth, buffers->upsampled, depthImage.size(), 0, 0,
+             cv::INTER_LINEAR);
+
+  // seed the pixels that could not be predicted yet (3 or fewer known
+  // pixels, see Propagate), if the coarser level reached them
+  KnownIntegral(depthImage, &buffers->knownI);
+  const int windowRadius = windowSize_ / 2;
+  const cv::Mat &target = buffers->target;
+  for (int y=0; y<depthImage.rows; y++) {
+    float *d = depthImage.ptr<float>(y);
+    const float *up = buffers->upsampled.ptr<float>(y);
+    const float *coarse = coarser.depth.ptr<float>(y / 2);
+    const uint8_t *t = target.empty() ? nullptr : target.ptr<uint8_t>(y);
+    for (int x=0; x<depthImage.cols; x++) {
+      if (d[x] != 0 || coarse[x / 2] == 0 || (t && !t[x]))
+        continue;
+      if (KnownInWindow(buffers->knownI, windowRadius, x, y) <= 3) {
+        d[x] = up[x];
+      }
+    }
+  }
+}
+
+void GDFMM::ComputeSpeed(const cv::Mat &rgbImage,
+                         Workspace::Buffers *buffersPtr) const {
+  Workspace::Buffers &buffers = *buffersPtr;
+  GDFMM_STATS_ONLY(Stats &stats = buffers.stats;)
+
+  // gradient image, then (Gaussian blur)
+  // resize rgb to depth image (specifically for Tango device)
+  cv::Mat &blurred = buffers.blurred;
+  cv::Mat &speedMap = buffers.speed;
+#ifdef GDFMM_HAVE_OPENCL
+  if (deviceSpeedMap_) {
+    // both stages on the device, only the speed map comes back
+    GDFMM_STATS_ONLY(StageTimer timer(&stats.speedMapSeconds);)
+    rgbImage.copyTo(buffers.deviceRgb);
+    ComputeSpeedMap(buffers.deviceRgb, blurSigma_, &buffers.deviceSpeed);
+    buffers.deviceSpeed.copyTo(speedMap);
+    return;
   }
+#endif
+  {
+    GDFMM_STATS_ONLY(StageTimer timer(&stats.blurSeconds);)
+    // isolated, so that a region of a larger image (InPaint with a roi)
+    // does not read the pixels around it
+    cv::GaussianBlur(rgbImage, blurred, cv::Size(0,0), blurSigma_, blurSigma_,
+                     cv::BORDER_REFLECT_101 | cv::BORDER_ISOLATED);
+  }
+
+  // Sobel gradient strength and speed in one pass
+  GDFMM_STATS_ONLY(StageTimer timer(&stats.speedMapSeconds);)
+  ComputeSpeedMap(blurred, &speedMap);
+}
+
+void GDFMM::Prepare(const cv::Mat &depthImage,
+                    const cv::Mat &rgbImage,
+                    Workspace *workspace) const {
+  if (rgbImage.cols != depthImage.cols || rgbImage.rows != depthImage.rows) {
+    throw std::runtime_error("Images must have same size.");
+  }
+  CHECK(depthImage.channels() == 1);
+  CHECK(rgbImage.depth() == CV_8U);
+  CHECK(rgbImage.channels() == 1 || rgbImage.channels() == 3);
+  Workspace::Buffers &buffers = *workspace->buffers();
+  buffers.stats.Clear();
+  {
+    GDFMM_STATS_ONLY(StageTimer timer(&buffers.stats.inputSeconds);)
+    depthImage.convertTo(buffers.depth, CV_32F);
+  }
+  ComputeSpeed(rgbImage, &buffers);
+  buffers.prepared = true;
+}
+
+template <class PredictMethod>
+void GDFMM::MarchLevel(const cv::Mat &rgbImage,
+                       int levels,
+                       bool speedMapReady,
+                       Workspace::Buffers *buffersPtr,
+                       PredictMethod *predict) const {
+  Workspace::Buffers &buffers = *buffersPtr;
+  cv::Mat &depthImage = buffers.depth;
+  Stats &stats = buffers.stats;
+
+  if (levels > 1 &&
+      std::min(depthImage.rows, depthImage.cols) / 2 >= static_cast<int>(windowSize_)) {
+    GDFMM_STATS_ONLY(StageTimer timer(&stats.pyramidSeconds);)
+    SeedFromCoarser(rgbImage, levels - 1, &buffers, *predict);
+  }
+
+  cv::Mat &speedMap = buffers.speed;
+  if (!speedMapReady) {
+    ComputeSpeed(rgbImage, &buffers);
+  }
+
+  // Debug ComputeSpeedMap
+//  {
+//  cv::Mat rescaled = -speedMap;
+//  cv::imshow("what", rescaled);
+//  cv::waitKey(0);
+//  }
 
+
+  {
+    GDFMM_STATS_ONLY(StageTimer timer(&stats.marchSeconds);)
+    const MarchOrder order = {queuePolicy_, wavefrontDelta_, wavefrontThreads_};
+    if (holeThreads_ != 1) {
+      MarchHoles(order, windowSize_ / 2, holeThreads_,
+                 &buffers, &depthImage, rgbImage, speedMap, *predict, &stats);
+    }
+    else if (tileSize_ > 0 &&
+        (depthImage.rows > tileSize_ || depthImage.cols > tileSize_)) {
+      MarchTiles(order, tileSize_, windowSize_ / 2, tileThreads_,
+                 &buffers, &depthImage, rgbImage, speedMap, *predict, &stats);
+    }
+    March(order, windowSize_ / 2, &buffers, &depthImage, rgbImage,
+          speedMap, predict, &stats);
+  }
+}
+
+template <class PredictMethod>
+cv::Mat GDFMM::InPaintBase(const cv::Mat &depthImageOriginal,
+                const cv::Mat &rgbImage,
+                cv::Mat *output,
+                int outputDepth,
+                Workspace *workspace,
+                PredictMethod *predict) const {
+  if (rgbImage.cols != depthImageOriginal.cols ||
+      rgbImage.rows != depthImageOriginal.rows) {
+    throw std::runtime_error("Images must have same size.");
+  }
+  std::unique_ptr<Workspace> localWorkspace;
+  if (!workspace) {
+    localWorkspace.reset(new Workspace);
+    workspace = localWorkspace.get();
+  }
+  Workspace::Buffers &buffers = *workspace->buffers();
+  cv::Mat &depthImage = buffers.depth;
+
+  CHECK(depthImageOriginal.channels() == 1);
+  CHECK(rgbImage.channels() == 1 || rgbImage.channels() == 3);
+  //cv::Mat result(depthImageOriginal.rows, depthImageOriginal.cols,
+  //                CV_32F);
+
+  // after Prepare, the depth buffer and speed map already hold this frame
+  const bool prepared = buffers.prepared;
+  buffers.prepared = false;
+  if (!prepared) {
+    buffers.stats.Clear();
+    GDFMM_STATS_ONLY(StageTimer timer(&buffers.stats.inputSeconds);)
+    depthImageOriginal.convertTo(depthImage, CV_32F);
+  }
+
+  MarchLevel(rgbImage, pyramidLevels_, prepared, &buffers, predict);
+
+  // the workspace keeps its buffers, so the result is always a new image
+  // or `output`
+  if (outputDepth < 0) {
+    return cv::Mat();
+  }
+  GDFMM_STATS_ONLY(StageTimer timer(&buffers.stats.outputSeconds);)
   if (output) {
-    depthImage.convertTo(*output, CV_64F);
+    depthImage.convertTo(*output, outputDepth);
     return *output;
   }
   else {
-    depthImage.convertTo(depthImage, CV_64F);
-    return depthImage;
+    cv::Mat result;
+    depthImage.convertTo(result, outputDepth);
+    return result;
   }
 }
 
-float GDFMM::BilateralWeight(const Point &p1,
-                      const Point &p2,
-                      const cv::Mat &rgbImage) {
-  assert(rgbImage.depth() == CV_8U);
-  assert(rgbImage.channels() == 3);
-  const uint8_t *c1 = rgbImage.at<uint8_t[3]>(p1.y, p1.x);
-  const uint8_t *c2 = rgbImage.at<uint8_t[3]>(p2.y, p2.x);
-  return
-      distExpCache_(p2.x - p1.x) *
-      distExpCache_(p2.y - p1.y) *
-      colorExpCache_((int)c1[0] - (int)c2[0]) *
-      colorExpCache_((int)c1[1] - (int)c2[1]) *
-      colorExpCache_((int)c1[2] - (int)c2[2]);
-}
-
 // float CorrelationWeight(const Point &p1,
 //                         const Point &p2,
 //                         const cv::Mat &rgbImage,
@@ -277,43 +1276,138 @@ float GDFMM::BilateralWeight(const Point &p1,
 //   // compute covariance... (ah shit)
 // }
 
+template <int kWindowSize, int kChannels>
 float GDFMM::PredictDepth(const cv::Mat &depthImage,
                          const cv::Mat &rgbImage,
-                         int x, int y) {
+                         int x, int y,
+                         int *knownCount) const {
   assert(depthImage.cols == rgbImage.cols);
   assert(depthImage.rows == rgbImage.rows);
 
-  float sumWeights = 0;
-  float sumValues = 0;
+  assert(rgbImage.depth() == CV_8U);
+  assert(rgbImage.channels() == kChannels);
+  assert(kWindowSize == 0 || kWindowSize == static_cast<int>(windowSize_));
+
+  const int windowSize = kWindowSize > 0 ? kWindowSize : windowSize_;
+  const int windowRadius = windowSize / 2;
+  WindowSums sums = {};
+  const uint8_t *center = rgbImage.ptr<uint8_t>(y) + kChannels * x;
+  const float *colorTable = colorExpCache_.Centered();
+
+  int lowerX = std::max(0, x - windowRadius);
+  int upperX = std::min(depthImage.cols - 1, x + windowRadius);
+  int length = upperX - lowerX + 1;
+
+  // Without the depth gradient term of the paper (see
+  // PredictDepthGradient), a window row is a plain weighted sum.
+  for (int n = std::max(0, y - windowRadius);
+       n <= std::min(depthImage.rows - 1, y + windowRadius);
+       n++) {
+    const float *kernelRow = spatialKernel_.get() +
+                             (n - y + windowRadius) * windowSize;
+    const float *depthRow = depthImage.ptr<float>(n) + lowerX;
+    const uint8_t *guideRow = rgbImage.ptr<uint8_t>(n) + kChannels * lowerX;
+    const float *kernel = kernelRow + lowerX - x + windowRadius;
+    if (kChannels == 3 && AccumulateRow != AccumulateRowScalar) {
+      // the SIMD kernels give the same sums as AccumulateRowFixed
+      AccumulateRow(depthRow, guideRow, kernel, center, colorTable,
+                    length, &sums);
+    }
+    else if (kWindowSize > 0 && length == windowSize) {
+      AccumulateRowFixed<kChannels, kWindowSize>(
+          depthRow, guideRow, kernel, center, colorTable, length, &sums);
+    }
+    else {
+      AccumulateRowFixed<kChannels, 0>(
+          depthRow, guideRow, kernel, center, colorTable, length, &sums);
+    }
+  }
+
+  GDFMM_STATS_ONLY(*knownCount = sums.count;)
+  if (sums.count <= 3) {
+    return 0;
+  }
+  return ReduceLanes(sums.values) / ReduceLanes(sums.weights);
+}
+
+float GDFMMInternals::PredictDepth(const GDFMM &gdfmm,
+                                   const cv::Mat &depthImage,
+                                   const cv::Mat &rgbImage,
+                                   int x, int y) {
+  bool color = rgbImage.channels() == 3;
+  int knownCount = 0;
+  switch (gdfmm.windowSize_) {
+    case 5:
+      return color ? gdfmm.PredictDepth<5, 3>(depthImage, rgbImage, x, y, &knownCount)
+                   : gdfmm.PredictDepth<5, 1>(depthImage, rgbImage, x, y, &knownCount);
+    case 7:
+      return color ? gdfmm.PredictDepth<7, 3>(depthImage, rgbImage, x, y, &knownCount)
+                   : gdfmm.PredictDepth<7, 1>(depthImage, rgbImage, x, y, &knownCount);
+    case 11:
+      return color ? gdfmm.PredictDepth<11, 3>(depthImage, rgbImage, x, y, &knownCount)
+                   : gdfmm.PredictDepth<11, 1>(depthImage, rgbImage, x, y, &knownCount);
+    default:
+      return color ? gdfmm.PredictDepth<0, 3>(depthImage, rgbImage, x, y, &knownCount)
+                   : gdfmm.PredictDepth<0, 1>(depthImage, rgbImage, x, y, &knownCount);
+  }
+}
+
+/* PredictDepth with the depth gradient term of the paper: every known
+ * pixel (m, n) predicts its depth plus gradient . (x - m, y - n). */
+template <int kChannels>
+float GDFMM::PredictDepthGradient(const cv::Mat &depthImage,
+                                  const cv::Mat &gradient,
+                                  const cv::Mat &rgbImage,
+                                  int x, int y,
+                                  int *knownCount) const {
+  assert(depthImage.size() == gradient.size());
+  assert(gradient.type() == CV_32FC2);
+  assert(rgbImage.channels() == kChannels);
+
+  const int windowRadius = windowSize_ / 2;
+  const uint8_t *center = rgbImage.ptr<uint8_t>(y) + kChannels * x;
+  const float *colorTable = colorExpCache_.Centered();
+  float sumValues = 0, sumExtrapolated = 0, sumWeights = 0;
   int count = 0;
-  int windowRadius = windowSize_ / 2;
 
   for (int n = std::max(0, y - windowRadius);
-       n <= std::min(depthImage.rows - 1, static_cast<int>(y + windowRadius));
+       n <= std::min(depthImage.rows - 1, y + windowRadius);
        n++) {
+    const float *kernelRow = spatialKernel_.get() +
+                             (n - y + windowRadius) * windowSize_;
+    const float *depthRow = depthImage.ptr<float>(n);
+    const cv::Vec2f *gradientRow = gradient.ptr<cv::Vec2f>(n);
+    const uint8_t *guideRow = rgbImage.ptr<uint8_t>(n);
     for (int m = std::max(0, x - windowRadius);
-         m <= std::min(depthImage.cols - 1, static_cast<int>(x + windowRadius));
+         m <= std::min(depthImage.cols - 1, x + windowRadius);
          m++) {
-      float depth = depthImage.at<float>(n, m);
-      if (depth == 0) // invalid
+      float d = depthRow[m];
+      if (d == 0) // invalid
         continue;
 
-      float weight = std::max((float)1e-6, BilateralWeight(Point{x,y}, Point{m,n}, rgbImage));
-    ///  float weight2 = CorrelationWeight(Point{x,y}, Point{m,n}, rgbImage, windowRadius);
-
-      float gX, gY;
-      std::tie(gX, gY) = ComputeDepthGradient(depthImage, m, n);
-      float gradientTerm = gX * (x-m) + gY * (y-n);
-
-      sumValues += weight * (depth /*+ gradientTerm*/);
+      const uint8_t *c = guideRow + kChannels * m;
+      float weight = kernelRow[m - x + windowRadius];
+      for (int ch = 0; ch < kChannels; ch++) {
+        weight *= colorTable[(int)center[ch] - (int)c[ch]];
+      }
+      weight = std::max((float)1e-6, weight);
+      const cv::Vec2f &g = gradientRow[m];
+      sumValues += weight * d;
+      sumExtrapolated += weight * (d + g[0] * (x - m) + g[1] * (y - n));
       sumWeights += weight;
-      count ++;
+      count++;
     }
   }
 
+  GDFMM_STATS_ONLY(*knownCount = count;)
   if (count <= 3) {
     return 0;
   }
+  // steep extrapolations can leave the valid range; 0 would mean the
+  // pixel cannot be predicted
+  if (sumExtrapolated > 0) {
+    return sumExtrapolated / sumWeights;
+  }
   return sumValues / sumWeights;
 }
 
@@ -329,141 +1423,52 @@ float GDFMM::PredictDepth2(const cv::Mat &depthImage,
                          int x, int y,
                          float epsilon,
                          float constant,
-                         float truncation) {
+                         float truncation,
+                         int *knownCount) const {
   assert(depthImage.cols == rgbImage.cols);
   assert(depthImage.rows == rgbImage.rows);
   assert(depthImage.depth() == CV_32F);
+  assert(rgbImage.depth() == CV_8U);
+  assert(rgbImage.channels() == 3);
+  (void)constant;  // drops out, see WindowStatistics::Solve
 
   int windowRadius = windowSize_ / 2;
-
-  // Count known pixels in the window
   int lowerY = std::max(0, y - windowRadius);
   int lowerX = std::max(0, x - windowRadius);
   int upperY = std::min(depthImage.rows - 1, static_cast<int>(y + windowRadius));
   int upperX = std::min(depthImage.cols - 1, static_cast<int>(x + windowRadius));
 
-  int num_known = 0;
+  // one pass for the regression sums and the depth range
+  WindowStatistics::Sums window = WindowStatistics::Sums();
+  float minDepth = std::numeric_limits<float>::max(),
+        maxDepth = std::numeric_limits<float>::lowest();
   for (int n = lowerY; n <= upperY; n++) {
+    const float *depthRow = depthImage.ptr<float>(n);
+    const uint8_t *rgbRow = rgbImage.ptr<uint8_t>(n);
     for (int m = lowerX; m <= upperX; m++) {
-      if (depthImage.at<float>(n, m) == 0) {
+      const float d = depthRow[m];
+      if (d == 0) {
         continue;
       }
-      else {
-        num_known++;
-      }
+      WindowStatistics::Add(rgbRow + 3 * m, d, &window);
+      minDepth = std::min(minDepth, d);
+      maxDepth = std::max(maxDepth, d);
     }
   }
 
-  if (num_known <= 3) {
-    return 0;
-    throw std::runtime_error("Too few known values. "
-        "Try densifying your depth image first, "
-        "or increasing the window size.");
+  GDFMM_STATS_ONLY(*knownCount = window.count;)
+  float prediction = WindowStatistics::Solve(
+      window, rgbImage.ptr<uint8_t>(y) + 3 * x, epsilon);
+  if (window.count <= 3 || truncation < 0) {
+    return prediction;
   }
 
-  // Build the array
-  Eigen::Array<float, Eigen::Dynamic, 4> X(num_known, 4);
-  Eigen::Array<float, Eigen::Dynamic, 1> Y(num_known);
-  int index = 0;
-  for (int n = lowerY; n <= upperY; n++) {
-    for (int m = lowerX; m <= upperX; m++) {
-      if (depthImage.at<float>(n, m) == 0) {
-        continue;
-      }
-      else {
-        X(index, 0) = rgbImage.at<uint8_t[3]>(n, m)[0];
-        X(index, 1) = rgbImage.at<uint8_t[3]>(n, m)[1];
-        X(index, 2) = rgbImage.at<uint8_t[3]>(n, m)[2];
-        X(index, 3) = 0;
-        Y(index) = depthImage.at<float>(n, m);
-        index++;
-      }
-    }
-  }
-
-  // Find mean
-  Eigen::Array<float, 1, 4> mX = X.colwise().mean();
-  Eigen::Array<float, 1, 1> mY = Y.colwise().mean();
-
-  // normalize x...
-  X = X.rowwise() - mX;
-  Y = Y.rowwise() - mY;
-
-  Eigen::Array<float, 1, 4> sX = sqrt((X * X).colwise().mean());
-  sX = sX.max(0.00001);
-  sX(0, 3) = 1;
-  X.col(3).fill(constant);
-  constant = std::max(0.00001f, constant);
-
-  X = X.rowwise() / sX;
-
-  // Find covariance
-  Eigen::Matrix4f cov = X.transpose().matrix() * X.matrix();
-  Eigen::Matrix4f reg;
-  reg << epsilon, 0, 0, 0,
-         0, epsilon, 0, 0,
-         0, 0, epsilon, 0,
-         0, 0, 0, epsilon;
-
-  cov = cov + reg;
-
-  // make prediction
-  Eigen::Vector4f beta;
-  Eigen::Array<float, 1, 4> xy = (X.colwise() * Y).colwise().sum();
-  beta = cov.ldlt().solve(xy.matrix().transpose());
-//  Eigen::Array<float, 1, 4> xy = (X.colwise() * Y).colwise().mean();
-//  beta = cov.ldlt().solve(xy.matrix().transpose());
-
-  Eigen::Vector4f test(
-            rgbImage.at<uint8_t[3]>(y, x)[0],
-            rgbImage.at<uint8_t[3]>(y, x)[1],
-            rgbImage.at<uint8_t[3]>(y, x)[2],
-            0);
-  test = ( (test.transpose().array() - mX) / sX).transpose().matrix();
-  test(3) = constant;
-
-  assert(rgbImage.depth() == CV_8U);
-  assert(rgbImage.channels() == 3);
-//  std::cout << "Y" << std::endl
-//            << Y.transpose() << std::endl;
-//  std::cout << "X" << std::endl
-//            << X.transpose() << std::endl;
-//  std::cout << "beta: " << beta << std::endl;
-//  std::cout << "test: " << test << std::endl;
-//  std::cout << "cov: " << cov << std::endl;
-//  std::cout << "xy: " << xy << std::endl;
-//  std::cout << num_known << std::endl;
-//  std::cout << beta.dot(test) << std::endl;
-  float prediction = beta.dot(test) + mY(0,0);
-  assert(!std::isnan(prediction));
-
   // constrain the results to within a sane range
-//  float meanY = Y.mean();
-//  Eigen::Matrix<float, Eigen::Dynamic, 1> Y_mY = (Y - meanY).matrix();
-//  float varY = Y_mY.transpose() * Y_mY;
-//  varY /= (num_known - 1);
-//  float stdY = sqrt(varY);
-//
-//  prediction = std::max(meanY - 2 * stdY, prediction);
-//  prediction = std::min(meanY + 2 * stdY, prediction);
-//  float minY = Y.minCoeff();
-//  float maxY = Y.maxCoeff();
-//  float rangeY = maxY - minY;
-//  prediction = std::max(minY - rangeY * truncation, prediction);
-//  prediction = std::min(maxY + rangeY * truncation, prediction);
-
+  float range = maxDepth - minDepth;
+  prediction = std::max(minDepth - range * truncation, prediction);
+  prediction = std::min(maxDepth + range * truncation, prediction);
   return prediction;
 }
 
-static float ComputeSpeed(const cv::Mat &gradientStrength,
-                          const Point &position)
-{
-  return -1.0f / (1 +
-      gradientStrength.at<float[3]>(position.y, position.x)[0] +
-      gradientStrength.at<float[3]>(position.y, position.x)[1] +
-      gradientStrength.at<float[3]>(position.y, position.x)[2]
-      );
-}
-
 
 };
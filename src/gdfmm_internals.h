@@ -0,0 +1,40 @@
+#pragma once
+
+#include "gdfmm/gdfmm.h"
+
+#include <opencv2/core/core.hpp>
+
+namespace gdfmm {
+
+/* Access to the private lookups and predictions of GDFMM, for the
+ * benchmarks. The inputs are those of the march: CV_32F depth, zero where
+ * missing, and an 8-bit reference of the same size. */
+struct GDFMMInternals {
+  // ExpCache entries of the spatial and color weights
+  static float DistanceWeight(const GDFMM &gdfmm, int d) {
+    return gdfmm.distExpCache_(d);
+  }
+  static float ColorWeight(const GDFMM &gdfmm, int d) {
+    return gdfmm.colorExpCache_(d);
+  }
+
+  // PredictDepth for the window size and channels InPaint would pick
+  static float PredictDepth(const GDFMM &gdfmm,
+                            const cv::Mat &depthImage,
+                            const cv::Mat &rgbImage,
+                            int x, int y);
+
+  static float PredictDepth2(const GDFMM &gdfmm,
+                             const cv::Mat &depthImage,
+                             const cv::Mat &rgbImage,
+                             int x, int y,
+                             float epsilon,
+                             float constant,
+                             float truncation) {
+    int knownCount = 0;
+    return gdfmm.PredictDepth2(depthImage, rgbImage, x, y, epsilon, constant,
+                               truncation, &knownCount);
+  }
+};
+
+}  // namespace gdfmm
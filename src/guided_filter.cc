@@ -1,4 +1,12 @@
 #include "gdfmm/gdfmm.h"
+#ifdef GDFMM_HAVE_OPENCL
+#include "gdfmm/umat.h"
+#endif
+#include "parallel.h"
+#include "box_guided_filter.h"
+#include "integral_window.h"
+#include "stats.h"
+#include "workspace.h"
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -9,111 +17,88 @@
 #include <algorithm>
 #include <utility>
 #include <cassert>
+#include <vector>
 
 #include <eigen3/Eigen/Eigen>
 #include <cstdio>
 
 namespace gdfmm {
 
-static inline double sumAt(
-                            const cv::Mat &imageI,
-                            int x, int y,
-                            int windowSize, int *pixCount = 0) {
-  assert(imageI.depth() == CV_64F);
-
-  double sum;
-  int n;
-  Point topLeft, bottomRight, topRight, bottomLeft;
-  int windowRadius = windowSize / 2;
-
-  topLeft.x = std::max(0, x - windowRadius);
-  topLeft.y = std::max(0, y - windowRadius);
-
-  bottomRight.x = std::min(imageI.cols - 1, x + windowRadius + 1);
-  bottomRight.y = std::min(imageI.rows - 1, y + windowRadius + 1);
-
-  topRight.y = topLeft.y;
-  topRight.x = bottomRight.x;
-  bottomLeft.x = topLeft.x;
-  bottomLeft.y = bottomRight.y;
-
-  sum = imageI.at<double>(bottomRight.y, bottomRight.x)
-      + imageI.at<double>(topLeft.y, topLeft.x)
-      - imageI.at<double>(topRight.y, topRight.x)
-      - imageI.at<double>(bottomLeft.y, bottomLeft.x);
-
-  n = (bottomRight.y - topLeft.y) * (bottomRight.x - topLeft.x);
-  if (pixCount) *pixCount = n;
-  return sum;
+/* Buffers from options.workspace, or `local` without a workspace. */
+static GuidedFilterBuffers *FilterBuffers(const GuidedFilterOptions &options,
+                                          GuidedFilterBuffers *local) {
+  if (options.workspace) {
+    return &options.workspace->buffers()->guidedFilter;
+  }
+  return local;
 }
 
-static inline Eigen::Vector3d sumAt3(
-                            const cv::Mat &imageI,
-                            int x, int y,
-                            int windowSize, int *pixCount = 0) {
-  assert(imageI.depth() == CV_64F);
-
-  Eigen::Vector3d sum;
-  int n;
-  Point topLeft, bottomRight, topRight, bottomLeft;
-  int windowRadius = windowSize / 2;
-
-  topLeft.x = std::max(0, x - windowRadius);
-  topLeft.y = std::max(0, y - windowRadius);
-
-  bottomRight.x = std::min(imageI.cols - 1, x + windowRadius + 1);
-  bottomRight.y = std::min(imageI.rows - 1, y + windowRadius + 1);
-
-  topRight.y = topLeft.y;
-  topRight.x = bottomRight.x;
-  bottomLeft.x = topLeft.x;
-  bottomLeft.y = bottomRight.y;
-
-#define SUM_OF_CHANNEL(i) \
-          (imageI.at<cv::Vec3d>(bottomRight.y, bottomRight.x)[i] \
-        + imageI.at<cv::Vec3d>(topLeft.y, topLeft.x)[i] \
-        - imageI.at<cv::Vec3d>(topRight.y, topRight.x)[i] \
-        - imageI.at<cv::Vec3d>(bottomLeft.y, bottomLeft.x)[i] )
-
-  sum(0) = SUM_OF_CHANNEL(0);
-  sum(1) = SUM_OF_CHANNEL(1);
-  sum(2) = SUM_OF_CHANNEL(2);
-
-#undef SUM_OF_CHANNEL
-
-  n = (bottomRight.y - topLeft.y) * (bottomRight.x - topLeft.x);
-  if (pixCount) *pixCount = n;
-  return sum;
+/* Converts the CV_32F or object-depth `result` into the output image. The
+ * result is never returned itself, since it may belong to a workspace. */
+static cv::Mat FinishOutput(const cv::Mat &result, int depth,
+                            cv::Mat *output) {
+  if (output) {
+    result.convertTo(*output, depth);
+    return *output;
+  }
+  else {
+    cv::Mat image;
+    result.convertTo(image, depth);
+    return image;
+  }
 }
 
-static inline double meanAt(const cv::Mat &imageI,
-                            int x, int y, int windowSize, int *pixCount = 0) {
-  int n;
-  double sum;
-  sum = sumAt(imageI, x, y, windowSize, &n);
-  if (pixCount)
-    *pixCount = n;
-  return sum / n;
+/* Coefficients of one window of the 3-channel filter, from the window sums
+ * over `pixCount` pixels of the object, the reference, the object times
+ * the reference and the reference channel products (i <= j at 3*i + j). */
+static inline void SolveWindow3(int pixCount,
+                                double obj_sum,
+                                const Eigen::Vector3d &ref_sum,
+                                const double ref_sqSum[9],
+                                const Eigen::Vector3d &objref_sum,
+                                float epsilon,
+                                Eigen::Vector3f *Av,
+                                float *Bv) {
+  double cov[9];
+  for (int i=0; i<3; i++) {
+    for (int j=i; j<3; j++) {
+      // compute entry in cov matrix
+      cov[3*i + j] = ref_sqSum[3*i + j] / (pixCount - 1) -
+                (ref_sum[i] * ref_sum[j] / pixCount / (pixCount - 1));
+    }
+  }
+  Eigen::Vector3f ref_mean = ref_sum.cast<float>() / pixCount;
+  float obj_mean = static_cast<float>(obj_sum) / pixCount;
+
+  // E(X^2) - E(X)^2
+  Eigen::Matrix3f covariance;
+  covariance << cov[0] + epsilon, cov[1], cov[2],
+                cov[1], cov[4] + epsilon, cov[5],
+                cov[2], cov[5], cov[8] + epsilon;
+
+  // compute a
+  *Av = covariance.ldlt().solve( (objref_sum/pixCount).cast<float>() - ref_mean*obj_mean );
+  *Bv = obj_sum / pixCount - Av->dot(ref_mean);
 }
 
-/* implementation for 3-channel references */
-cv::Mat GuidedFilter3(const cv::Mat &objectO,
-                     const cv::Mat &referenceO,
-                     cv::Mat *output,
-                     int windowSize,
-                     float epsilon) {
-  using std::unique_ptr;
-  assert(referenceO.channels() == 3);
-  cv::Mat object;
-  cv::Mat objectI;
-  cv::Mat reference;
-  cv::Mat referenceI;
-  unique_ptr<cv::Mat[]> reference2I;
-  cv::Mat objref;
-  cv::Mat objrefI;
+/* Linear coefficients for 3-channel references: object ~ A . reference + B
+ * in every window. `object` is CV_32F, `reference` CV_32FC3. Integral
+ * images are kept in `buffers`. */
+static void Coefficients3(const cv::Mat &object,
+                          const cv::Mat &reference,
+                          int windowSize,
+                          float epsilon,
+                          int numThreads,
+                          GuidedFilterBuffers *buffers,
+                          cv::Mat *Aout,
+                          cv::Mat *Bout) {
+  assert(reference.channels() == 3);
+  cv::Mat &objectI = buffers->objectI;
+  cv::Mat &referenceI = buffers->referenceI;
+  cv::Mat *reference2I = buffers->reference2I;
+  cv::Mat &objref = buffers->objref;
+  cv::Mat &objrefI = buffers->objrefI;
 
-  objectO.convertTo(object, CV_32F);
-  referenceO.convertTo(reference, CV_32F);
   reference.copyTo(objref);
   // objref = objref.mul(reference);
   for (int y=0; y<object.rows; y++) {
@@ -129,8 +114,6 @@ cv::Mat GuidedFilter3(const cv::Mat &objectO,
   cv::integral(objref, objrefI, CV_64F);
 
   // covariance for reference2I
-  int size2I = reference.channels() * reference.channels();
-  reference2I.reset(new cv::Mat[reference.channels() * reference.channels()]);
   for (int i=0; i<3; i++) {
     for (int j=i; j<3; j++) {
       int index = 3*i + j;
@@ -168,184 +151,582 @@ cv::Mat GuidedFilter3(const cv::Mat &objectO,
   }
 
   // compute the gradient for each cell
-  cv::Mat A(object.rows, object.cols, CV_32FC3);
-  cv::Mat B(object.rows, object.cols, CV_32FC1);
+  Aout->create(object.rows, object.cols, CV_32FC3);
+  Bout->create(object.rows, object.cols, CV_32FC1);
+  cv::Mat &A = *Aout;
+  cv::Mat &B = *Bout;
 
   // compute the variance in each window, a, and b
-  for (int y=0; y<object.rows; y++) {
-    for (int x=0; x<object.cols; x++) {
-      // compute variance
-      int pixCount;
-      float variance;
-
-      Eigen::Vector3d ref_sum = sumAt3(referenceI, x, y, windowSize, &pixCount);
-      double ref_sqSum[9]; // compute Σrr, Σrg, etc.
-      double cov[9];
-      for (int i=0; i<3; i++) {
-        for (int j=i; j<3; j++) {
-          ref_sqSum[3*i + j] = sumAt(reference2I[3*i + j], x, y, windowSize, &pixCount);
-          
-          // compute entry in cov matrix
-          cov[3*i + j] = ref_sqSum[3*i + j] / (pixCount - 1) -
-                    (ref_sum[i] * ref_sum[j] / pixCount / (pixCount - 1));
+  ParallelForRows(object.rows, numThreads, [&](int begin, int end) {
+    for (int y=begin; y<end; y++) {
+      for (int x=0; x<object.cols; x++) {
+        // compute variance
+        int pixCount;
+
+        Eigen::Vector3d ref_sum = sumAt3(referenceI, x, y, windowSize, &pixCount);
+        double ref_sqSum[9]; // compute Σrr, Σrg, etc.
+        for (int i=0; i<3; i++) {
+          for (int j=i; j<3; j++) {
+            ref_sqSum[3*i + j] = sumAt(reference2I[3*i + j], x, y, windowSize, &pixCount);
+          }
         }
-      }
-      Eigen::Vector3f ref_mean = ref_sum.cast<float>() / pixCount;
 
-      double obj_sum = sumAt(objectI, x, y, windowSize);
-      float obj_mean = static_cast<float>(obj_sum) / pixCount;
+        double obj_sum = sumAt(objectI, x, y, windowSize);
+        Eigen::Vector3d objref_sum = sumAt3(objrefI, x, y, windowSize);
+
+        Eigen::Vector3f Av;
+        float Bv;
+        SolveWindow3(pixCount, obj_sum, ref_sum, ref_sqSum, objref_sum,
+                     epsilon, &Av, &Bv);
 
-      Eigen::Vector3d objref_sum = sumAt3(objrefI, x, y, windowSize);
+        A.at<cv::Vec3f>(y,x)[0] = Av[0];
+        A.at<cv::Vec3f>(y,x)[1] = Av[1];
+        A.at<cv::Vec3f>(y,x)[2] = Av[2];
 
-      // E(X^2) - E(X)^2
-      Eigen::Matrix3f covariance;
-      covariance << cov[0] + epsilon, cov[1], cov[2],
-                    cov[1], cov[4] + epsilon, cov[5],
-                    cov[2], cov[5], cov[8] + epsilon;
+        B.at<float>(y,x) = Bv;
 
-      // compute a
-      Eigen::Vector3f Av = covariance.ldlt().solve( (objref_sum/pixCount).cast<float>() - ref_mean*obj_mean );
-      float Bv = obj_sum / pixCount - Av.dot(ref_mean);
+  //      As[y * object.cols + x] = covariance.lldt().solve( (objref_sum/pixCount) - ref_mean*obj_mean ).cast<float>();
+  //      // compute b
+  //      Bs[y * object.cols + x] = obj_sum / pixCount
+  //                                - As[y*object.cols + x].T().cast<float>() * ref_mean;
+      }
+    }
+  });
+}
 
-      A.at<cv::Vec3f>(y,x)[0] = Av[0];
-      A.at<cv::Vec3f>(y,x)[1] = Av[1];
-      A.at<cv::Vec3f>(y,x)[2] = Av[2];
+/* implementation for 3-channel references */
+static cv::Mat GuidedFilter3(const cv::Mat &objectO,
+                     const cv::Mat &referenceO,
+                     cv::Mat *output,
+                     int windowSize,
+                     float epsilon,
+                     const GuidedFilterOptions &options) {
+  assert(referenceO.channels() == 3);
+  GuidedFilterBuffers localBuffers;
+  GuidedFilterBuffers &buffers = *FilterBuffers(options, &localBuffers);
+  cv::Mat &object = buffers.object;
+  cv::Mat &reference = buffers.reference;
+  cv::Mat &A = buffers.A, &B = buffers.B;
 
-      B.at<float>(y,x) = Bv;
+  objectO.convertTo(object, CV_32F);
+  referenceO.convertTo(reference, CV_32F);
+  Coefficients3(object, reference, windowSize, epsilon, options.numThreads,
+                &buffers, &A, &B);
 
-//      As[y * object.cols + x] = covariance.lldt().solve( (objref_sum/pixCount) - ref_mean*obj_mean ).cast<float>();
-//      // compute b
-//      Bs[y * object.cols + x] = obj_sum / pixCount
-//                                - As[y*object.cols + x].T().cast<float>() * ref_mean;
-    }
-  }
-  
-  cv::Mat AI, BI, result(object.rows, object.cols, CV_32F);
+  cv::Mat &AI = buffers.AI, &BI = buffers.BI, &result = buffers.result;
+  result.create(object.rows, object.cols, CV_32F);
 
   cv::integral(A, AI, CV_64F);
   cv::integral(B, BI, CV_64F);
 
-  for (int y=0; y<object.rows; y++) {
-    for (int x=0; x<object.cols; x++) {
-      int count;
-      Eigen::Vector3f sumA = sumAt3(AI, x, y, windowSize, &count).cast<float>();
-      Eigen::Map<Eigen::Vector3f> ref(&reference.at<cv::Vec3f>(y,x)[0]);
+  ParallelForRows(object.rows, options.numThreads, [&](int begin, int end) {
+    for (int y=begin; y<end; y++) {
+      for (int x=0; x<object.cols; x++) {
+        int count;
+        Eigen::Vector3f sumA = sumAt3(AI, x, y, windowSize, &count).cast<float>();
+        Eigen::Map<Eigen::Vector3f> ref(&reference.at<cv::Vec3f>(y,x)[0]);
+
+        result.at<float>(y,x) = sumA.dot(ref) / count + meanAt(BI, x, y, windowSize);
+      }
+    }
+  });
+  return FinishOutput(result, objectO.depth(), output);
+}
+static inline float KahanAdd(float sum, float value, float *compensation) {
+  float y = value - *compensation;
+  float t = sum + y;
+  *compensation = (t - sum) - y;
+  return t;
+}
 
-      result.at<float>(y,x) = sumA.dot(ref) / count + meanAt(BI, x, y, windowSize);
+/* CV_32F integral image of the multi-channel CV_32F `image`, summed along
+ * rows and then down columns, optionally with Kahan compensation in both
+ * directions. `carry` holds the compensation terms. */
+static void FloatIntegral(const cv::Mat &image,
+                          bool compensated,
+                          std::vector<float> *carry,
+                          cv::Mat *integralImage) {
+  const int channels = image.channels();
+  const int width = image.cols * channels;
+  integralImage->create(image.rows + 1, image.cols + 1,
+                        CV_MAKETYPE(CV_32F, channels));
+  // column compensations, then row sums and row compensations
+  carry->assign(width + 2 * channels, 0.0f);
+  float *columnCarry = &(*carry)[0];
+  float *rowSum = columnCarry + width;
+  float *rowCarry = rowSum + channels;
+
+  std::fill(integralImage->ptr<float>(0),
+            integralImage->ptr<float>(0) + width + channels, 0.0f);
+  for (int y=0; y<image.rows; y++) {
+    const float *in = image.ptr<float>(y);
+    const float *above = integralImage->ptr<float>(y) + channels;
+    float *out = integralImage->ptr<float>(y + 1);
+    for (int k=0; k<channels; k++) {
+      out[k] = rowSum[k] = rowCarry[k] = 0;
+    }
+    out += channels;
+    for (int i=0; i<width; i+=channels) {
+      for (int k=0; k<channels; k++) {
+        if (compensated) {
+          rowSum[k] = KahanAdd(rowSum[k], in[i + k], &rowCarry[k]);
+          out[i + k] = KahanAdd(above[i + k], rowSum[k], &columnCarry[i + k]);
+        }
+        else {
+          rowSum[k] += in[i + k];
+          out[i + k] = above[i + k] + rowSum[k];
+        }
+      }
     }
   }
-  result.convertTo(result, objectO.depth());
-  
-  if (output) {
-    *output = result;
-    return result;
+}
+
+/* Tiles of the float-precision 3-channel filter, and its window sums:
+ * the object, the 3 reference channels, the 3 object-reference products
+ * and the 6 reference channel products. */
+static const int kFilterTileSize = 64;
+static const int kTileTerms = 13;
+
+/* Sums of all channels of the tile integral `integralImage` of `region`
+ * over the window of (x, y), clipped to the `rows` x `cols` image like
+ * sumAt. Returns the pixel count. The integral has a row and column more
+ * than `region`, so `right` and `bottom` may reach `cols` and `rows`. */
+static inline int TileWindowSums(const cv::Mat &integralImage,
+                                 const cv::Rect &region,
+                                 int rows, int cols,
+                                 int x, int y, int windowSize,
+                                 double *sums) {
+  int windowRadius = windowSize / 2;
+  int left = std::max(0, x - windowRadius);
+  int top = std::max(0, y - windowRadius);
+  int right = std::min(cols, x + windowRadius + 1);
+  int bottom = std::min(rows, y + windowRadius + 1);
+  const int channels = integralImage.channels();
+  const float *topRow = integralImage.ptr<float>(top - region.y);
+  const float *bottomRow = integralImage.ptr<float>(bottom - region.y);
+  const int l = (left - region.x) * channels, r = (right - region.x) * channels;
+  for (int k=0; k<channels; k++) {
+    sums[k] = static_cast<double>(bottomRow[r + k]) + topRow[l + k]
+            - topRow[r + k] - bottomRow[l + k];
+  }
+  return (bottom - top) * (right - left);
+}
+
+/* 3-channel filter on single-precision integral images of tiles.
+ *
+ * Every tile of kFilterTileSize pixels builds the integral images of its
+ * windows, i.e. of the tile grown by windowSize / 2, after subtracting
+ * the mean object and reference of that region. The coefficients of a
+ * window do not change when its inputs are shifted by a constant, so the
+ * result is the same as GuidedFilter3 up to rounding; centring keeps the
+ * sums small, and the tile keeps them few, so that float suffices. */
+static cv::Mat TiledGuidedFilter3(const cv::Mat &objectO,
+                                  const cv::Mat &referenceO,
+                                  cv::Mat *output,
+                                  int windowSize,
+                                  float epsilon,
+                                  const GuidedFilterOptions &options) {
+  assert(referenceO.channels() == 3);
+  GuidedFilterBuffers localBuffers;
+  GuidedFilterBuffers &buffers = *FilterBuffers(options, &localBuffers);
+  cv::Mat &object = buffers.object;
+  cv::Mat &reference = buffers.reference;
+  cv::Mat &A = buffers.A, &B = buffers.B, &result = buffers.result;
+
+  objectO.convertTo(object, CV_32F);
+  referenceO.convertTo(reference, CV_32F);
+  const int rows = object.rows, cols = object.cols;
+  A.create(rows, cols, CV_32FC3);
+  B.create(rows, cols, CV_32F);
+  result.create(rows, cols, CV_32F);
+
+  const bool compensated =
+      options.precision == GuidedFilterOptions::kCompensatedPrecision;
+  const int windowRadius = windowSize / 2;
+  const int tilesX = (cols + kFilterTileSize - 1) / kFilterTileSize;
+  const int tilesY = (rows + kFilterTileSize - 1) / kFilterTileSize;
+  auto tileAt = [&](int i, cv::Rect *tile, cv::Rect *region) {
+    *tile = cv::Rect((i % tilesX) * kFilterTileSize,
+                     (i / tilesX) * kFilterTileSize,
+                     kFilterTileSize, kFilterTileSize);
+    *tile &= cv::Rect(0, 0, cols, rows);
+    *region = cv::Rect(tile->x - windowRadius, tile->y - windowRadius,
+                       tile->width + 2 * windowRadius,
+                       tile->height + 2 * windowRadius);
+    *region &= cv::Rect(0, 0, cols, rows);
+  };
+
+  // coefficients
+  ParallelForRows(tilesX * tilesY, options.numThreads, [&](int begin, int end) {
+    cv::Mat terms, termsI;
+    std::vector<float> carry;
+    double sums[kTileTerms];
+    for (int i=begin; i<end; i++) {
+      cv::Rect tile, region;
+      tileAt(i, &tile, &region);
+      const double objectMean = cv::mean(object(region))[0];
+      const cv::Scalar referenceMean = cv::mean(reference(region));
+
+      terms.create(region.height, region.width, CV_MAKETYPE(CV_32F, kTileTerms));
+      for (int y=0; y<region.height; y++) {
+        const float *obj = object.ptr<float>(region.y + y) + region.x;
+        const float *ref = reference.ptr<float>(region.y + y) + 3 * region.x;
+        float *t = terms.ptr<float>(y);
+        for (int x=0; x<region.width; x++, t+=kTileTerms) {
+          float o = obj[x] - static_cast<float>(objectMean);
+          float c[3];
+          for (int k=0; k<3; k++) {
+            c[k] = ref[3 * x + k] - static_cast<float>(referenceMean[k]);
+          }
+          t[0] = o;
+          t[1] = c[0]; t[2] = c[1]; t[3] = c[2];
+          t[4] = o * c[0]; t[5] = o * c[1]; t[6] = o * c[2];
+          t[7] = c[0] * c[0]; t[8] = c[0] * c[1]; t[9] = c[0] * c[2];
+          t[10] = c[1] * c[1]; t[11] = c[1] * c[2]; t[12] = c[2] * c[2];
+        }
+      }
+      FloatIntegral(terms, compensated, &carry, &termsI);
+
+      Eigen::Vector3f shift(static_cast<float>(referenceMean[0]),
+                            static_cast<float>(referenceMean[1]),
+                            static_cast<float>(referenceMean[2]));
+      for (int y=tile.y; y<tile.y + tile.height; y++) {
+        for (int x=tile.x; x<tile.x + tile.width; x++) {
+          int pixCount = TileWindowSums(termsI, region, rows, cols,
+                                        x, y, windowSize, sums);
+          const double ref_sqSum[9] = {
+            sums[7], sums[8], sums[9],
+            0, sums[10], sums[11],
+            0, 0, sums[12]
+          };
+          Eigen::Vector3f Av;
+          float Bv;
+          SolveWindow3(pixCount, sums[0],
+                       Eigen::Vector3d(sums[1], sums[2], sums[3]), ref_sqSum,
+                       Eigen::Vector3d(sums[4], sums[5], sums[6]),
+                       epsilon, &Av, &Bv);
+          // undo the shift of the inputs
+          A.at<cv::Vec3f>(y,x)[0] = Av[0];
+          A.at<cv::Vec3f>(y,x)[1] = Av[1];
+          A.at<cv::Vec3f>(y,x)[2] = Av[2];
+          B.at<float>(y,x) = Bv + static_cast<float>(objectMean) - Av.dot(shift);
+        }
+      }
+    }
+  });
+
+  // window means of the coefficients, B again centred per tile
+  ParallelForRows(tilesX * tilesY, options.numThreads, [&](int begin, int end) {
+    cv::Mat terms, termsI;
+    std::vector<float> carry;
+    double sums[4];
+    for (int i=begin; i<end; i++) {
+      cv::Rect tile, region;
+      tileAt(i, &tile, &region);
+      const double bMean = cv::mean(B(region))[0];
+
+      terms.create(region.height, region.width, CV_32FC4);
+      for (int y=0; y<region.height; y++) {
+        const float *a = A.ptr<float>(region.y + y) + 3 * region.x;
+        const float *b = B.ptr<float>(region.y + y) + region.x;
+        float *t = terms.ptr<float>(y);
+        for (int x=0; x<region.width; x++) {
+          t[4 * x] = a[3 * x];
+          t[4 * x + 1] = a[3 * x + 1];
+          t[4 * x + 2] = a[3 * x + 2];
+          t[4 * x + 3] = b[x] - static_cast<float>(bMean);
+        }
+      }
+      FloatIntegral(terms, compensated, &carry, &termsI);
+
+      for (int y=tile.y; y<tile.y + tile.height; y++) {
+        for (int x=tile.x; x<tile.x + tile.width; x++) {
+          int count = TileWindowSums(termsI, region, rows, cols,
+                                     x, y, windowSize, sums);
+          Eigen::Vector3f sumA(static_cast<float>(sums[0]),
+                               static_cast<float>(sums[1]),
+                               static_cast<float>(sums[2]));
+          Eigen::Map<Eigen::Vector3f> ref(&reference.at<cv::Vec3f>(y,x)[0]);
+          result.at<float>(y,x) = sumA.dot(ref) / count
+              + sums[3] / count + bMean;
+        }
+      }
+    }
+  });
+  return FinishOutput(result, objectO.depth(), output);
+}
+
+/* Linear coefficients for 1-channel references. `object` and `reference`
+ * are CV_32F. Integral images are kept in `buffers`. */
+static void Coefficients1(const cv::Mat &object,
+                          const cv::Mat &reference,
+                          int windowSize,
+                          float epsilon,
+                          int numThreads,
+                          GuidedFilterBuffers *buffers,
+                          cv::Mat *Aout,
+                          cv::Mat *Bout) {
+  cv::Mat &objectI = buffers->objectI;
+  cv::Mat &referenceI = buffers->referenceI;
+  cv::Mat &reference2I = buffers->reference2I[0];
+  cv::Mat &objref = buffers->objref;
+  cv::Mat &objrefI = buffers->objrefI;
+
+  cv::multiply(object, reference, objref);
+
+  cv::integral(object, objectI, CV_64F);
+  cv::integral(reference, referenceI, reference2I, CV_64F);
+  cv::integral(objref, objrefI, CV_64F);
+
+  // compute the gradient for each cell
+  Aout->create(object.rows, object.cols, CV_32F);
+  Bout->create(object.rows, object.cols, CV_32F);
+  cv::Mat &A = *Aout;
+  cv::Mat &B = *Bout;
+
+  // compute the variance in each window, a, and b
+  ParallelForRows(object.rows, numThreads, [&](int begin, int end) {
+    for (int y=begin; y<end; y++) {
+      for (int x=0; x<object.cols; x++) {
+        // compute variance
+        int pixCount;
+        float variance;
+        double ref_sqSum = sumAt(reference2I, x, y, windowSize, &pixCount),
+                ref_sum = sumAt(referenceI, x, y, windowSize);
+        float ref_mean = static_cast<float>(ref_sum) / pixCount;
+
+        double obj_sum = sumAt(objectI, x, y, windowSize);
+        float obj_mean = static_cast<float>(obj_sum) / pixCount;
+
+        double objref_sum = sumAt(objrefI, x, y, windowSize);
+
+        // E(X^2) - E(X)^2
+        variance = (static_cast<float>(ref_sqSum) / pixCount)
+              - ref_mean * ref_mean;
+
+        // compute a
+        A.at<float>(y,x) = 
+          ( (objref_sum)/pixCount
+              - ref_mean * obj_mean  )
+          /
+          (variance + epsilon);
+        // compute b
+        B.at<float>(y,x) = static_cast<float>(obj_sum) / pixCount
+            - A.at<float>(y,x) * ref_mean;
+      }
+    }
+  });
+}
+
+/* Mean of every window, clipped at the borders, of a 1- or 3-channel
+ * CV_32F image. */
+static cv::Mat WindowMean(const cv::Mat &image, int windowSize,
+                          int numThreads) {
+  cv::Mat imageI, mean(image.rows, image.cols, image.type());
+  cv::integral(image, imageI, CV_64F);
+
+  ParallelForRows(image.rows, numThreads, [&](int begin, int end) {
+    for (int y=begin; y<end; y++) {
+      for (int x=0; x<image.cols; x++) {
+        if (image.channels() == 3) {
+          int count;
+          Eigen::Vector3d sum = sumAt3(imageI, x, y, windowSize, &count);
+          for (int c=0; c<3; c++) {
+            mean.at<cv::Vec3f>(y,x)[c] = static_cast<float>(sum(c) / count);
+          }
+        }
+        else {
+          mean.at<float>(y,x) = static_cast<float>(meanAt(imageI, x, y, windowSize));
+        }
+      }
+    }
+  });
+  return mean;
+}
+
+/* Fast guided filter (He & Sun, 2015): the coefficients are computed on a
+ * nearest-neighbour subsampled pair, and their window means are upsampled
+ * bilinearly before the final A . I + B at full resolution. */
+static cv::Mat FastGuidedFilter(const cv::Mat &objectO,
+                                const cv::Mat &referenceO,
+                                cv::Mat *output,
+                                int windowSize,
+                                float epsilon,
+                                const GuidedFilterOptions &options) {
+  int s = options.subsample;
+  int channels = referenceO.channels();
+  cv::Mat object, reference;
+  objectO.convertTo(object, CV_32F);
+  referenceO.convertTo(reference, CV_32F);
+
+  cv::Size smallSize(std::max(1, object.cols / s), std::max(1, object.rows / s));
+  cv::Mat objectSmall, referenceSmall;
+  cv::resize(object, objectSmall, smallSize, 0, 0, cv::INTER_NEAREST);
+  cv::resize(reference, referenceSmall, smallSize, 0, 0, cv::INTER_NEAREST);
+  int smallWindow = 2 * std::max(1, windowSize / 2 / s) + 1;
+
+  GuidedFilterBuffers localBuffers;
+  GuidedFilterBuffers &buffers = *FilterBuffers(options, &localBuffers);
+  cv::Mat &A = buffers.A, &B = buffers.B;
+  if (channels == 3) {
+    Coefficients3(objectSmall, referenceSmall, smallWindow, epsilon,
+                  options.numThreads, &buffers, &A, &B);
   }
   else {
-    return result;
+    Coefficients1(objectSmall, referenceSmall, smallWindow, epsilon,
+                  options.numThreads, &buffers, &A, &B);
   }
+
+  cv::Mat meanA, meanB;
+  cv::resize(WindowMean(A, smallWindow, options.numThreads), meanA,
+             object.size(), 0, 0, cv::INTER_LINEAR);
+  cv::resize(WindowMean(B, smallWindow, options.numThreads), meanB,
+             object.size(), 0, 0, cv::INTER_LINEAR);
+
+  cv::Mat result(object.rows, object.cols, CV_32F);
+  ParallelForRows(object.rows, options.numThreads, [&](int begin, int end) {
+    for (int y=begin; y<end; y++) {
+      const float *a = meanA.ptr<float>(y);
+      const float *b = meanB.ptr<float>(y);
+      const float *ref = reference.ptr<float>(y);
+      float *out = result.ptr<float>(y);
+      for (int x=0; x<object.cols; x++) {
+        float q = b[x];
+        for (int c=0; c<channels; c++) {
+          q += a[x * channels + c] * ref[x * channels + c];
+        }
+        out[x] = q;
+      }
+    }
+  });
+  return FinishOutput(result, objectO.depth(), output);
 }
+
 cv::Mat GuidedFilter(const cv::Mat &object,
                      const cv::Mat &referenceO,
                      cv::Mat *output,
                      int windowSize,
                      float epsilon) {
+  return GuidedFilter(object, referenceO, output, windowSize, epsilon,
+                      GuidedFilterOptions());
+}
+
+cv::Mat GuidedFilter(const cv::Mat &object,
+                     const cv::Mat &reference,
+                     const cv::Rect &roi,
+                     cv::Mat *output,
+                     int windowSize,
+                     float epsilon,
+                     const GuidedFilterOptions &options) {
+  const cv::Rect frame(0, 0, object.cols, object.rows);
+  if (roi.area() == 0 || (roi & frame) != roi) {
+    throw "ROI outside the images";
+  }
+  // A and B are averaged over a window too, so the apron is twice the
+  // window radius
+  const int apron = 2 * (windowSize / 2);
+  cv::Rect region(roi.x - apron, roi.y - apron,
+                  roi.width + 2 * apron, roi.height + 2 * apron);
+  region &= frame;
+  cv::Mat filtered = GuidedFilter(object(region), reference(region), nullptr,
+                                  windowSize, epsilon, options);
+  const cv::Mat cropped = filtered(cv::Rect(roi.x - region.x, roi.y - region.y,
+                                            roi.width, roi.height));
+  if (output) {
+    cropped.copyTo(*output);
+    return *output;
+  }
+  return cropped.clone();
+}
+
+cv::Mat GuidedFilter(const cv::Mat &object,
+                     const cv::Mat &referenceO,
+                     cv::Mat *output,
+                     int windowSize,
+                     float epsilon,
+                     const GuidedFilterOptions &options) {
   if (object.rows != referenceO.rows ||
       object.cols != referenceO.cols) {
     throw "Images have different size";
   }
-  if (referenceO.channels() == 3) {
-    return GuidedFilter3(object, referenceO, output, windowSize, epsilon);
+  GDFMM_STATS_ONLY(StageTimer timer(options.workspace ?
+      &options.workspace->buffers()->stats.filterSeconds : nullptr);)
+  if (options.engine == GuidedFilterOptions::kBoxFilterEngine) {
+    return BoxGuidedFilter(object, referenceO, output, windowSize, epsilon,
+                           options.numThreads);
   }
-  else if (referenceO.channels() != 1) {
+  if (options.engine == GuidedFilterOptions::kOpenCLEngine) {
+#ifdef GDFMM_HAVE_OPENCL
+    cv::UMat objectU, referenceU, resultU;
+    object.copyTo(objectU);
+    referenceO.copyTo(referenceU);
+    GuidedFilter(objectU, referenceU, &resultU, windowSize, epsilon);
+    return FinishOutput(resultU.getMat(cv::ACCESS_READ), object.depth(),
+                        output);
+#else
+    throw "GuidedFilterOptions::kOpenCLEngine needs GDFMM_OPENCL";
+#endif
+  }
+  if (referenceO.channels() != 1 && referenceO.channels() != 3) {
     throw "Wrong number of channels";
   }
+  if (options.subsample > 1) {
+    return FastGuidedFilter(object, referenceO, output, windowSize, epsilon,
+                            options);
+  }
+  if (referenceO.channels() == 3) {
+    if (options.precision != GuidedFilterOptions::kDoublePrecision) {
+      return TiledGuidedFilter3(object, referenceO, output, windowSize,
+                                epsilon, options);
+    }
+    return GuidedFilter3(object, referenceO, output, windowSize, epsilon,
+                         options);
+  }
 
-  cv::Mat objectI;
-  cv::Mat reference;
-  cv::Mat referenceI;
-  cv::Mat reference2I;
-  cv::Mat objref;
-  cv::Mat objrefI;
+  GuidedFilterBuffers localBuffers;
+  GuidedFilterBuffers &buffers = *FilterBuffers(options, &localBuffers);
+  cv::Mat &reference = buffers.reference;
+  cv::Mat &objectF = buffers.object;
+  cv::Mat &A = buffers.A, &B = buffers.B;
 
-  object.convertTo(objref, CV_32F);
+  object.convertTo(objectF, CV_32F);
   referenceO.convertTo(reference, CV_32F);
-  objref = objref.mul(reference);
+  Coefficients1(objectF, reference, windowSize, epsilon, options.numThreads,
+                &buffers, &A, &B);
 
-  cv::integral(object, objectI, CV_64F);
-  cv::integral(reference, referenceI, reference2I, CV_64F);
-  cv::integral(objref, objrefI, CV_64F);
-
-  // compute the gradient for each cell
-  cv::Mat A(object.rows, object.cols, CV_32F);
-  cv::Mat B(object.rows, object.cols, CV_32F);
-
-  // compute the variance in each window, a, and b
-  for (int y=0; y<object.rows; y++) {
-    for (int x=0; x<object.cols; x++) {
-      // compute variance
-      int pixCount;
-      float variance;
-      double ref_sqSum = sumAt(reference2I, x, y, windowSize, &pixCount),
-              ref_sum = sumAt(referenceI, x, y, windowSize);
-      float ref_mean = static_cast<float>(ref_sum) / pixCount;
-
-      double obj_sum = sumAt(objectI, x, y, windowSize);
-      float obj_mean = static_cast<float>(obj_sum) / pixCount;
-
-      double objref_sum = sumAt(objrefI, x, y, windowSize);
-
-      // E(X^2) - E(X)^2
-      variance = (static_cast<float>(ref_sqSum) / pixCount)
-            - ref_mean * ref_mean;
-
-      // compute a
-      A.at<float>(y,x) = 
-        ( (objref_sum)/pixCount
-            - ref_mean * obj_mean  )
-        /
-        (variance + epsilon);
-      // compute b
-      B.at<float>(y,x) = static_cast<float>(obj_sum) / pixCount
-          - A.at<float>(y,x) * ref_mean;
-    }
-  }
-  
-  cv::Mat AI, BI, result(object.rows, object.cols, object.depth());
+  cv::Mat &AI = buffers.AI, &BI = buffers.BI, &result = buffers.result;
+  result.create(object.rows, object.cols, object.depth());
 
   cv::integral(A, AI, CV_64F);
   cv::integral(B, BI, CV_64F);
 
-  for (int y=0; y<object.rows; y++) {
-    for (int x=0; x<object.cols; x++) {
-      switch (object.depth()) {
-        case CV_64F:
-          result.at<double>(y,x) = static_cast<double>(meanAt(AI, x, y, windowSize) * reference.at<float>(y, x)
-              + meanAt(BI, x, y, windowSize));
-          break;
-        case CV_32F:
-          result.at<float>(y,x) = static_cast<float>(meanAt(AI, x, y, windowSize) * reference.at<float>(y, x)
-              + meanAt(BI, x, y, windowSize));
-          break;
-        case CV_8U:
-          result.at<uint8_t>(y,x) = static_cast<uint8_t>(meanAt(AI, x, y, windowSize) * reference.at<float>(y, x)
-              + meanAt(BI, x, y, windowSize));
-          break;
-        case CV_16U:
-          result.at<uint16_t>(y,x) = static_cast<uint16_t>(meanAt(AI, x, y, windowSize) * reference.at<float>(y, x)
-              + meanAt(BI, x, y, windowSize));
-          break;
-        default:
-          assert(false);
-          break;
+  ParallelForRows(object.rows, options.numThreads, [&](int begin, int end) {
+    for (int y=begin; y<end; y++) {
+      for (int x=0; x<object.cols; x++) {
+        switch (object.depth()) {
+          case CV_64F:
+            result.at<double>(y,x) = static_cast<double>(meanAt(AI, x, y, windowSize) * reference.at<float>(y, x)
+                + meanAt(BI, x, y, windowSize));
+            break;
+          case CV_32F:
+            result.at<float>(y,x) = static_cast<float>(meanAt(AI, x, y, windowSize) * reference.at<float>(y, x)
+                + meanAt(BI, x, y, windowSize));
+            break;
+          case CV_8U:
+            result.at<uint8_t>(y,x) = static_cast<uint8_t>(meanAt(AI, x, y, windowSize) * reference.at<float>(y, x)
+                + meanAt(BI, x, y, windowSize));
+            break;
+          case CV_16U:
+            result.at<uint16_t>(y,x) = static_cast<uint16_t>(meanAt(AI, x, y, windowSize) * reference.at<float>(y, x)
+                + meanAt(BI, x, y, windowSize));
+            break;
+          default:
+            assert(false);
+            break;
+        }
       }
     }
-  }
-  if (output) {
-    *output = result;
-    return result;
-  }
-  else {
-    return result;
-  }
+  });
+  return FinishOutput(result, object.depth(), output);
 }
 }  // namespace gdfmm
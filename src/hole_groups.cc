@@ -0,0 +1,79 @@
+#include "hole_groups.h"
+
+#include <algorithm>
+
+namespace gdfmm {
+
+void HoleGroups::Find(const cv::Mat &depthImage, int radius) {
+  const int rows = depthImage.rows, cols = depthImage.cols;
+  cols_ = cols;
+  bounds_.clear();
+
+  // Grown squares of half size radius / 2 around pixels at most radius
+  // apart touch or overlap, so their pixels become 8-connected.
+  const int grow = radius / 2;
+  std::vector<int> rowCount(cols + 1);
+  columnHits_.resize(rows * cols);
+  for (int y=0; y<rows; y++) {
+    const float *depth = depthImage.ptr<float>(y);
+    rowCount[0] = 0;
+    for (int x=0; x<cols; x++) {
+      rowCount[x + 1] = rowCount[x] + (depth[x] == 0);
+    }
+    for (int x=0; x<cols; x++) {
+      columnHits_[y * cols + x] = rowCount[std::min(cols, x + grow + 1)] -
+                                 rowCount[std::max(0, x - grow)] > 0;
+    }
+  }
+  grown_.assign(rows * cols, 0);
+  std::vector<int> columnCount(rows + 1);
+  for (int x=0; x<cols; x++) {
+    columnCount[0] = 0;
+    for (int y=0; y<rows; y++) {
+      columnCount[y + 1] = columnCount[y] + columnHits_[y * cols + x];
+    }
+    for (int y=0; y<rows; y++) {
+      grown_[y * cols + x] = columnCount[std::min(rows, y + grow + 1)] -
+                             columnCount[std::max(0, y - grow)] > 0;
+    }
+  }
+
+  // 8-connected components of the grown mask
+  labels_.assign(rows * cols, -1);
+  holeLabels_.assign(rows * cols, -1);
+  for (int start=0; start<rows * cols; start++) {
+    if (!grown_[start] || labels_[start] >= 0)
+      continue;
+    int label = static_cast<int>(bounds_.size());
+    int left = cols, top = rows, right = -1, bottom = -1;
+    labels_[start] = label;
+    stack_.assign(1, start);
+    while (!stack_.empty()) {
+      int i = stack_.back();
+      stack_.pop_back();
+      int x = i % cols, y = i / cols;
+      if (depthImage.at<float>(y, x) == 0) {
+        holeLabels_[i] = label;
+        left = std::min(left, x);
+        right = std::max(right, x);
+        top = std::min(top, y);
+        bottom = std::max(bottom, y);
+      }
+      for (int ny = std::max(0, y - 1); ny <= std::min(rows - 1, y + 1); ny++) {
+        for (int nx = std::max(0, x - 1); nx <= std::min(cols - 1, x + 1); nx++) {
+          int n = ny * cols + nx;
+          if (grown_[n] && labels_[n] < 0) {
+            labels_[n] = label;
+            stack_.push_back(n);
+          }
+        }
+      }
+    }
+    bounds_.push_back(cv::Rect(left - radius, top - radius,
+                               right - left + 1 + 2 * radius,
+                               bottom - top + 1 + 2 * radius) &
+                      cv::Rect(0, 0, cols, rows));
+  }
+}
+
+}  // namespace gdfmm
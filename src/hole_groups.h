@@ -0,0 +1,41 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+namespace gdfmm {
+
+/** \brief Missing depth pixels, grouped so that groups can be inpainted
+ * independently.
+ *
+ * The prediction window of a pixel reaches `radius` pixels in every
+ * direction. Two missing pixels at most `radius` apart can therefore see
+ * each other, and end up in the same group. A pixel of one group never
+ * reads a missing pixel of another group.
+ * */
+class HoleGroups {
+  public:
+  /** \brief Groups the zero pixels of the CV_32F `depthImage`.
+   *
+   * Storage from earlier calls is reused.
+   * */
+  void Find(const cv::Mat &depthImage, int radius);
+
+  int size() const { return static_cast<int>(bounds_.size()); }
+  /** \brief Missing pixels of group `i`, grown by `radius` and clipped to
+   * the image. This covers every prediction window of the group. */
+  const cv::Rect &Bounds(int i) const { return bounds_[i]; }
+  /** \brief Group of pixel (x, y), or -1 if it is not missing. */
+  int Label(int x, int y) const { return holeLabels_[y * cols_ + x]; }
+
+  private:
+  int cols_;
+  // missing pixels grown by radius / 2, for the connectivity
+  std::vector<int> columnHits_;
+  std::vector<uint8_t> grown_;
+  std::vector<int> labels_, holeLabels_;
+  std::vector<int> stack_;
+  std::vector<cv::Rect> bounds_;
+};
+
+}  // namespace gdfmm
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "gdfmm/gdfmm.h"
+
+#include <opencv2/core/core.hpp>
+#include <eigen3/Eigen/Eigen>
+#include <algorithm>
+#include <cassert>
+
+namespace gdfmm {
+
+/* Window sums over CV_64F integral images (cv::integral), for the guided
+ * filter. The window of (x, y) reaches windowSize / 2 pixels in every
+ * direction and is clipped to the image; `pixCount` receives the number
+ * of pixels it covers. */
+inline double sumAt(
+                            const cv::Mat &imageI,
+                            int x, int y,
+                            int windowSize, int *pixCount = 0) {
+  assert(imageI.depth() == CV_64F);
+
+  double sum;
+  int n;
+  Point topLeft, bottomRight, topRight, bottomLeft;
+  int windowRadius = windowSize / 2;
+
+  topLeft.x = std::max(0, x - windowRadius);
+  topLeft.y = std::max(0, y - windowRadius);
+
+  bottomRight.x = std::min(imageI.cols - 1, x + windowRadius + 1);
+  bottomRight.y = std::min(imageI.rows - 1, y + windowRadius + 1);
+
+  topRight.y = topLeft.y;
+  topRight.x = bottomRight.x;
+  bottomLeft.x = topLeft.x;
+  bottomLeft.y = bottomRight.y;
+
+  sum = imageI.at<double>(bottomRight.y, bottomRight.x)
+      + imageI.at<double>(topLeft.y, topLeft.x)
+      - imageI.at<double>(topRight.y, topRight.x)
+      - imageI.at<double>(bottomLeft.y, bottomLeft.x);
+
+  n = (bottomRight.y - topLeft.y) * (bottomRight.x - topLeft.x);
+  if (pixCount) *pixCount = n;
+  return sum;
+}
+
+inline Eigen::Vector3d sumAt3(
+                            const cv::Mat &imageI,
+                            int x, int y,
+                            int windowSize, int *pixCount = 0) {
+  assert(imageI.depth() == CV_64F);
+
+  Eigen::Vector3d sum;
+  int n;
+  Point topLeft, bottomRight, topRight, bottomLeft;
+  int windowRadius = windowSize / 2;
+
+  topLeft.x = std::max(0, x - windowRadius);
+  topLeft.y = std::max(0, y - windowRadius);
+
+  bottomRight.x = std::min(imageI.cols - 1, x + windowRadius + 1);
+  bottomRight.y = std::min(imageI.rows - 1, y + windowRadius + 1);
+
+  topRight.y = topLeft.y;
+  topRight.x = bottomRight.x;
+  bottomLeft.x = topLeft.x;
+  bottomLeft.y = bottomRight.y;
+
+#define SUM_OF_CHANNEL(i) \
+          (imageI.at<cv::Vec3d>(bottomRight.y, bottomRight.x)[i] \
+        + imageI.at<cv::Vec3d>(topLeft.y, topLeft.x)[i] \
+        - imageI.at<cv::Vec3d>(topRight.y, topRight.x)[i] \
+        - imageI.at<cv::Vec3d>(bottomLeft.y, bottomLeft.x)[i] )
+
+  sum(0) = SUM_OF_CHANNEL(0);
+  sum(1) = SUM_OF_CHANNEL(1);
+  sum(2) = SUM_OF_CHANNEL(2);
+
+#undef SUM_OF_CHANNEL
+
+  n = (bottomRight.y - topLeft.y) * (bottomRight.x - topLeft.x);
+  if (pixCount) *pixCount = n;
+  return sum;
+}
+
+inline double meanAt(const cv::Mat &imageI,
+                            int x, int y, int windowSize, int *pixCount = 0) {
+  int n;
+  double sum;
+  sum = sumAt(imageI, x, y, windowSize, &n);
+  if (pixCount)
+    *pixCount = n;
+  return sum / n;
+}
+
+}  // namespace gdfmm
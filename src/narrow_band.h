@@ -0,0 +1,125 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace gdfmm {
+
+/* Narrow-band containers for the fast march in GDFMM::InPaintBase.
+ *
+ * Both containers pop the entry with the largest key first and share the
+ * subset of the std::priority_queue interface used by the march. */
+
+/** \brief A band entry: the key above a 32-bit linear pixel index.
+ *
+ * The key is stored as order-preserving bits, so entries compare like
+ * their keys when shifted down by 32, and the whole entry can be radix
+ * sorted.
+ * */
+typedef uint64_t BandEntry;
+
+inline BandEntry MakeBandEntry(float key, uint32_t index) {
+  uint32_t bits;
+  std::memcpy(&bits, &key, sizeof(bits));
+  // flip negative keys entirely, and the sign of the others
+  bits ^= (bits & 0x80000000u) ? 0xffffffffu : 0x80000000u;
+  return static_cast<BandEntry>(bits) << 32 | index;
+}
+inline float BandKey(BandEntry entry) {
+  uint32_t bits = static_cast<uint32_t>(entry >> 32);
+  bits ^= (bits & 0x80000000u) ? 0x80000000u : 0xffffffffu;
+  float key;
+  std::memcpy(&key, &bits, sizeof(key));
+  return key;
+}
+inline uint32_t BandIndex(BandEntry entry) {
+  return static_cast<uint32_t>(entry);
+}
+
+/** \brief Exact binary heap over the speed values.
+ *
+ * Same ordering as std::priority_queue, but the storage is kept across
+ * Clear() so that a reused band does not reallocate.
+ * */
+class HeapBand {
+  public:
+  void Clear() { heap_.clear(); }
+  void emplace(float key, uint32_t index) {
+    heap_.push_back(MakeBandEntry(key, index));
+    std::push_heap(heap_.begin(), heap_.end(), Compare());
+  }
+  BandEntry top() const { return heap_.front(); }
+  void pop() {
+    std::pop_heap(heap_.begin(), heap_.end(), Compare());
+    heap_.pop_back();
+  }
+  size_t size() const { return heap_.size(); }
+
+  private:
+  // keys only, so that equal keys are popped as by std::priority_queue
+  struct Compare {
+    bool operator()(BandEntry p1, BandEntry p2) const {
+      return (p1 >> 32) < (p2 >> 32);
+    }
+  };
+  std::vector<BandEntry> heap_;
+};
+
+/** \brief Untidy bucket queue over quantized speed values.
+ *
+ * Keys in [minKey, maxKey] are quantized into buckets of width
+ * 1/bucketsPerUnit; keys outside the range are clamped into the first or
+ * last bucket. Entries within one bucket are popped in LIFO order, so the
+ * ordering is exact up to the bucket width. Push and pop are O(1)
+ * amortized: the cursor only moves up on a push into a higher bucket and
+ * walks down over empty buckets on pop.
+ * */
+class BucketBand {
+  public:
+  BucketBand() : minKey_(0), scale_(1), top_(-1), size_(0) {}
+
+  /** \brief Empties the queue and sets its key range, keeping the
+   * capacity of the buckets. */
+  void Reset(float minKey, float maxKey, int bucketsPerUnit) {
+    for (size_t i=0; i<buckets_.size(); i++) {
+      buckets_[i].clear();
+    }
+    buckets_.resize(static_cast<size_t>((maxKey - minKey) * bucketsPerUnit) + 1);
+    minKey_ = minKey;
+    scale_ = static_cast<float>(bucketsPerUnit);
+    top_ = -1;
+    size_ = 0;
+  }
+
+  void emplace(float key, uint32_t index) {
+    int bucket = Bucket(key);
+    buckets_[bucket].push_back(MakeBandEntry(key, index));
+    top_ = std::max(top_, bucket);
+    size_++;
+  }
+  BandEntry top() const { return buckets_[top_].back(); }
+  void pop() {
+    buckets_[top_].pop_back();
+    size_--;
+    while (top_ >= 0 && buckets_[top_].empty()) {
+      top_--;
+    }
+  }
+  size_t size() const { return size_; }
+
+  private:
+  int Bucket(float key) const {
+    int bucket = static_cast<int>((key - minKey_) * scale_);
+    return std::min(std::max(bucket, 0),
+                    static_cast<int>(buckets_.size()) - 1);
+  }
+
+  std::vector<std::vector<BandEntry> > buckets_;
+  float minKey_, scale_;
+  int top_;
+  size_t size_;
+};
+
+}  // namespace gdfmm
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+
+namespace gdfmm {
+
+/* Splits [0, rows) into contiguous bands and runs body(band, begin, end)
+ * on each band on OpenCV's worker pool. Bands never share rows, so bodies
+ * may write their own rows of shared images without synchronization. */
+
+template <class F>
+class RowBandBody : public cv::ParallelLoopBody {
+  public:
+  RowBandBody(int rows, int bands, const F &body)
+    : rows_(rows), bands_(bands), body_(body) {}
+
+  void operator()(const cv::Range &range) const {
+    for (int band = range.start; band < range.end; band++) {
+      int begin = static_cast<int>(static_cast<long long>(rows_) * band / bands_);
+      int end = static_cast<int>(static_cast<long long>(rows_) * (band + 1) / bands_);
+      body_(band, begin, end);
+    }
+  }
+
+  private:
+  int rows_, bands_;
+  const F &body_;
+};
+
+/** \brief Number of bands ParallelForRows splits [0, rows) into, at
+ * least 1. */
+inline int RowBands(int rows, int numThreads) {
+  int bands = numThreads > 0 ? numThreads : cv::getNumThreads();
+  return std::max(1, std::min(bands, rows));
+}
+
+/** \brief As ParallelForRows, but runs `body(band, begin, end)`, where
+ * `band` is in [0, RowBands(rows, numThreads)), so that every band can
+ * keep buffers of its own.
+ * */
+template <class F>
+void ParallelForBands(int rows, int numThreads, const F &body) {
+  int bands = RowBands(rows, numThreads);
+  if (bands == 1) {
+    body(0, 0, rows);
+    return;
+  }
+  cv::parallel_for_(cv::Range(0, bands), RowBandBody<F>(rows, bands, body),
+                    bands);
+}
+
+/** \brief Runs `body(begin, end)` over row bands of [0, rows).
+ *
+ * @param[in] numThreads Number of bands. 1 runs `body` inline on the
+ * calling thread, 0 or less uses one band per OpenCV worker thread
+ * (see cv::setNumThreads).
+ * */
+template <class F>
+void ParallelForRows(int rows, int numThreads, const F &body) {
+  ParallelForBands(rows, numThreads, [&body](int, int begin, int end) {
+    body(begin, end);
+  });
+}
+
+}  // namespace gdfmm
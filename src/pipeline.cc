@@ -0,0 +1,224 @@
+#include "gdfmm/pipeline.h"
+
+#include "workspace.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace gdfmm {
+
+struct Pipeline::Frame {
+  cv::Mat depth, rgb;
+  // `rgb`, or `resized` to the size of `depth`
+  cv::Mat reference, resized;
+  cv::Mat result;
+  Workspace workspace;
+  Callback done;
+  std::exception_ptr error;
+};
+
+// Blocking FIFO of at most `capacity` frames.
+class Pipeline::FrameQueue {
+  public:
+  explicit FrameQueue(size_t capacity) : capacity_(capacity), closed_(false) {}
+
+  // waits while the queue is full
+  void Push(std::unique_ptr<Frame> frame) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    notFull_.wait(lock, [this] { return frames_.size() < capacity_; });
+    frames_.push_back(std::move(frame));
+    notEmpty_.notify_one();
+  }
+
+  // waits while the queue is empty; null once it is closed and drained
+  std::unique_ptr<Frame> Pop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    notEmpty_.wait(lock, [this] { return !frames_.empty() || closed_; });
+    if (frames_.empty()) {
+      return nullptr;
+    }
+    std::unique_ptr<Frame> frame = std::move(frames_.front());
+    frames_.pop_front();
+    notFull_.notify_one();
+    return frame;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    notEmpty_.notify_all();
+  }
+
+  private:
+  std::mutex mutex_;
+  std::condition_variable notFull_, notEmpty_;
+  std::deque<std::unique_ptr<Frame>> frames_;
+  size_t capacity_;
+  bool closed_;
+};
+
+struct Pipeline::State {
+  explicit State(size_t queueSize)
+    : input(queueSize), prepared(queueSize), marched(queueSize),
+      submitted(0), completed(0) {}
+
+  FrameQueue input, prepared, marched;
+  std::vector<std::thread> threads;
+
+  // completed frames, kept for their workspaces; and the frame counts
+  std::mutex mutex;
+  std::condition_variable completedChanged;
+  std::vector<std::unique_ptr<Frame>> spare;
+  long long submitted, completed;
+};
+
+Pipeline::Pipeline(const GDFMM &gdfmm,
+                   int filterWindowSize,
+                   float filterEpsilon,
+                   int queueSize)
+  : gdfmm_(gdfmm),
+    filterWindowSize_(filterWindowSize),
+    filterEpsilon_(filterEpsilon) {
+  if (queueSize < 1) {
+    throw std::runtime_error("Pipeline queues must hold at least one frame.");
+  }
+  state_.reset(new State(queueSize));
+  State &state = *state_;
+  state.threads.emplace_back(&Pipeline::Run, this, &state.input,
+                             &state.prepared, &Pipeline::PrepareFrame);
+  state.threads.emplace_back(&Pipeline::Run, this, &state.prepared,
+                             &state.marched, &Pipeline::MarchFrame);
+  state.threads.emplace_back(&Pipeline::Run, this, &state.marched,
+                             nullptr, &Pipeline::FilterFrame);
+}
+
+Pipeline::~Pipeline() {
+  // every stage closes the next queue once it has drained its own
+  state_->input.Close();
+  for (std::thread &thread : state_->threads) {
+    thread.join();
+  }
+}
+
+std::future<cv::Mat> Pipeline::Submit(const cv::Mat &depthImage,
+                                      const cv::Mat &rgbImage) {
+  auto promise = std::make_shared<std::promise<cv::Mat>>();
+  Submit(depthImage, rgbImage,
+         [promise] (const cv::Mat &result, std::exception_ptr error) {
+           if (error) {
+             promise->set_exception(error);
+           }
+           else {
+             promise->set_value(result);
+           }
+         });
+  return promise->get_future();
+}
+
+void Pipeline::Submit(const cv::Mat &depthImage,
+                      const cv::Mat &rgbImage,
+                      Callback done) {
+  std::unique_ptr<Frame> frame;
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    if (!state_->spare.empty()) {
+      frame = std::move(state_->spare.back());
+      state_->spare.pop_back();
+    }
+    state_->submitted++;
+  }
+  if (!frame) {
+    frame.reset(new Frame);
+  }
+  frame->depth = depthImage;
+  frame->rgb = rgbImage;
+  frame->done = std::move(done);
+  frame->error = nullptr;
+  state_->input.Push(std::move(frame));
+}
+
+void Pipeline::Flush() {
+  std::unique_lock<std::mutex> lock(state_->mutex);
+  const long long submitted = state_->submitted;
+  state_->completedChanged.wait(lock, [this, submitted] {
+    return state_->completed >= submitted;
+  });
+}
+
+void Pipeline::Run(FrameQueue *in, FrameQueue *out,
+                   void (Pipeline::*stage)(Frame *)) {
+  while (std::unique_ptr<Frame> frame = in->Pop()) {
+    // frames that failed in an earlier stage only pass through
+    if (!frame->error) {
+      try {
+        (this->*stage)(frame.get());
+      }
+      catch (...) {
+        frame->error = std::current_exception();
+      }
+    }
+    if (out) {
+      out->Push(std::move(frame));
+    }
+    else {
+      Complete(std::move(frame));
+    }
+  }
+  if (out) {
+    out->Close();
+  }
+}
+
+void Pipeline::PrepareFrame(Frame *frame) {
+  if (frame->rgb.size() != frame->depth.size()) {
+    cv::resize(frame->rgb, frame->resized, frame->depth.size());
+    frame->reference = frame->resized;
+  }
+  else {
+    frame->reference = frame->rgb;
+  }
+  gdfmm_.Prepare(frame->depth, frame->reference, &frame->workspace);
+}
+
+void Pipeline::MarchFrame(Frame *frame) {
+  // the inpainted depth stays in the CV_32F workspace buffer
+  gdfmm_.InPaintTo(frame->depth, frame->reference, nullptr, -1,
+                   &frame->workspace);
+}
+
+void Pipeline::FilterFrame(Frame *frame) {
+  if (filterWindowSize_ > 0) {
+    frame->result = gdfmm_.FilterInPainted(frame->depth, frame->reference,
+                                           filterWindowSize_, filterEpsilon_,
+                                           nullptr, &frame->workspace);
+  }
+  else {
+    frame->workspace.buffers()->depth.convertTo(
+        frame->result, gdfmm_.OutputDepth(frame->depth));
+  }
+}
+
+void Pipeline::Complete(std::unique_ptr<Frame> frame) {
+  frame->done(frame->error ? cv::Mat() : frame->result, frame->error);
+
+  // only the workspace is kept; the images belong to the caller
+  frame->depth.release();
+  frame->rgb.release();
+  frame->reference.release();
+  frame->result.release();
+  frame->done = nullptr;
+  frame->error = nullptr;
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  state_->spare.push_back(std::move(frame));
+  state_->completed++;
+  state_->completedChanged.notify_all();
+}
+
+}  // namespace gdfmm
@@ -0,0 +1,91 @@
+#include "speed_map.h"
+
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+namespace gdfmm {
+
+// cv::BORDER_REFLECT_101
+static inline int Reflect(int i, int n) {
+  if (n == 1) return 0;
+  if (i < 0) return -i;
+  if (i >= n) return 2 * n - 2 - i;
+  return i;
+}
+
+/* T is the pixel type and Acc an accumulator that holds the Sobel terms
+ * exactly. The loops run over plain arrays so that they vectorize. */
+template <typename T, typename Acc>
+static void SpeedMap(const cv::Mat &blurred, cv::Mat *speed) {
+  const int rows = blurred.rows, cols = blurred.cols;
+  const int channels = blurred.channels();
+  const int width = cols * channels;
+  // vertical terms for columns -1 .. cols
+  std::vector<Acc> smooth((cols + 2) * channels), diff((cols + 2) * channels);
+  std::vector<float> strength(cols);
+
+  for (int y=0; y<rows; y++) {
+    const T *above = blurred.ptr<T>(Reflect(y - 1, rows));
+    const T *row = blurred.ptr<T>(y);
+    const T *below = blurred.ptr<T>(Reflect(y + 1, rows));
+
+    // vertical pass: [1 2 1] for the x gradient, [-1 0 1] for y
+    Acc *s = &smooth[channels];
+    Acc *d = &diff[channels];
+    for (int i=0; i<width; i++) {
+      s[i] = static_cast<Acc>(above[i]) + 2 * static_cast<Acc>(row[i]) +
+             static_cast<Acc>(below[i]);
+      d[i] = static_cast<Acc>(below[i]) - static_cast<Acc>(above[i]);
+    }
+    for (int c=0; c<channels; c++) {
+      int left = Reflect(-1, cols), right = Reflect(cols, cols);
+      s[-channels + c] = s[left * channels + c];
+      d[-channels + c] = d[left * channels + c];
+      s[width + c] = s[right * channels + c];
+      d[width + c] = d[right * channels + c];
+    }
+
+    // horizontal pass: [-1 0 1] and [1 2 1], squared and summed over
+    // channels
+    for (int x=0; x<cols; x++) {
+      strength[x] = 0;
+    }
+    for (int c=0; c<channels; c++) {
+      for (int x=0; x<cols; x++) {
+        int i = x * channels + c;
+        float gx = static_cast<float>(s[i + channels] - s[i - channels]);
+        float gy = static_cast<float>(d[i - channels] + 2 * d[i] +
+                                      d[i + channels]);
+        strength[x] += gx * gx + gy * gy;
+      }
+    }
+
+    float *out = speed->ptr<float>(y);
+    for (int x=0; x<cols; x++) {
+      out[x] = -1.0f / (1 + strength[x]);
+    }
+  }
+}
+
+void ComputeSpeedMap(const cv::Mat &blurred, cv::Mat *speed) {
+  speed->create(blurred.rows, blurred.cols, CV_32F);
+  switch (blurred.depth()) {
+    case CV_8U:
+      SpeedMap<uint8_t, int>(blurred, speed);
+      break;
+    case CV_16U:
+      SpeedMap<uint16_t, int>(blurred, speed);
+      break;
+    case CV_32F:
+      SpeedMap<float, float>(blurred, speed);
+      break;
+    default: {
+      cv::Mat converted;
+      blurred.convertTo(converted, CV_32F);
+      SpeedMap<float, float>(converted, speed);
+      break;
+    }
+  }
+}
+
+}  // namespace gdfmm
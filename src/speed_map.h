@@ -0,0 +1,22 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+
+namespace gdfmm {
+
+/** \brief Fast-marching speed of every pixel of a blurred color image.
+ *
+ * For every pixel, the squared 3x3 Sobel gradients in x and y are summed
+ * over all channels into g, and the speed is -1 / (1 + g). This is the
+ * same as two cv::Sobel calls into CV_32F followed by the per-channel
+ * squares, but in one pass: only two rows of vertical Sobel terms are
+ * kept, instead of two full-size multi-channel float images. Borders are
+ * reflected like cv::BORDER_DEFAULT.
+ *
+ * @param[in] blurred 8-bit, 16-bit or float image with any number of
+ * channels
+ * @param[out] speed CV_32F, reallocated only if its size changed
+ * */
+void ComputeSpeedMap(const cv::Mat &blurred, cv::Mat *speed);
+
+}  // namespace gdfmm
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "gdfmm/gdfmm.h"
+
+#include <chrono>
+
+namespace gdfmm {
+
+/* Instrumentation behind Stats. Statements wrapped in GDFMM_STATS_ONLY
+ * are only compiled with GDFMM_STATS defined. */
+#ifdef GDFMM_STATS
+#define GDFMM_STATS_ONLY(...) __VA_ARGS__
+#else
+#define GDFMM_STATS_ONLY(...)
+#endif
+
+typedef std::chrono::steady_clock StatsClock;
+
+inline double SecondsSince(StatsClock::time_point start) {
+  return std::chrono::duration<double>(StatsClock::now() - start).count();
+}
+
+/** \brief Sets `*seconds` to the wall time of its scope; does nothing if
+ * `seconds` is null. */
+class StageTimer {
+  public:
+  explicit StageTimer(double *seconds)
+    : seconds_(seconds), start_(StatsClock::now()) {}
+  ~StageTimer() {
+    if (seconds_) {
+      *seconds_ = SecondsSince(start_);
+    }
+  }
+
+  private:
+  double *seconds_;
+  StatsClock::time_point start_;
+};
+
+/** \brief Adds the march counters and prediction time of `from` to `to`. */
+inline void AccumulateMarch(const Stats &from, Stats *to) {
+  to->predictSeconds += from.predictSeconds;
+  to->pushes += from.pushes;
+  to->pops += from.pops;
+  to->retries += from.retries;
+  to->predictions += from.predictions;
+  to->filledPixels += from.filledPixels;
+  to->knownCount += from.knownCount;
+}
+
+}  // namespace gdfmm
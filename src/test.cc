@@ -1,14 +1,424 @@
 #include "gdfmm/gdfmm.h"
+#include "gdfmm_internals.h"
+#include "window_kernel.h"
+#include "window_statistics.h"
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/calib3d/calib3d.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
-#include <cassert>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include <eigen3/Eigen/Eigen>
 
 using namespace gdfmm;
 
+// Checks count their failures rather than abort, so they also hold under
+// NDEBUG and every failing check is reported; main returns non-zero.
+static int failures = 0;
+#define EXPECT(expr) \
+  do { \
+    if (!(expr)) { \
+      std::printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+      failures++; \
+    } \
+  } while (0)
+
+/* Synthetic frame of four flat regions: a sloped 16-bit depth around 1500
+ * and a noisy 8-bit reference. */
+static void syntheticFrame(int rows, int cols, cv::Mat *depth, cv::Mat *rgb) {
+  std::mt19937 random(1);
+  std::uniform_int_distribution<int> noise(0, 9);
+  depth->create(rows, cols, CV_16U);
+  rgb->create(rows, cols, CV_8UC3);
+  for (int y=0; y<rows; y++) {
+    for (int x=0; x<cols; x++) {
+      int region = (x > cols / 2) + 2 * (y > rows / 2);
+      depth->at<uint16_t>(y, x) = 1000 + 200 * region + x + y / 2
+                                  + (7 * x + 3 * y) % 23;
+      for (int k=0; k<3; k++) {
+        rgb->at<cv::Vec3b>(y, x)[k] = 40 * region + 20 * k + noise(random);
+      }
+    }
+  }
+}
+
+/* Clears `count` random squares of 4 to 14 pixels in `depth`. */
+static void punchHoles(int count, cv::Mat *depth) {
+  std::mt19937 random(2);
+  std::uniform_int_distribution<int> size(2, 7);
+  for (int i=0; i<count; i++) {
+    int centerX = random() % depth->cols, centerY = random() % depth->rows;
+    int radius = size(random);
+    cv::Rect square(centerX - radius, centerY - radius, 2 * radius, 2 * radius);
+    (*depth)(square & cv::Rect(0, 0, depth->cols, depth->rows)).setTo(0);
+  }
+}
+
+/* Every row kernel the build and CPU support gives the same sums, bit for
+ * bit, as AccumulateRowScalar: on random rows of lengths 1 to 31 and of
+ * multiples of 8, at unaligned offsets, accumulated over two rows. */
+void test_row_kernels() {
+  std::vector<AccumulateRowFn> kernels;
+  std::vector<const char *> names;
+  kernels.push_back(AccumulateRowFixed<3, 0>);
+  names.push_back("fixed");
+#ifdef GDFMM_HAVE_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    kernels.push_back(AccumulateRowAVX2);
+    names.push_back("avx2");
+  }
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  kernels.push_back(AccumulateRowNEON);
+  names.push_back("neon");
+#endif
+
+  std::vector<float> table(511);
+  for (int i=0; i<511; i++) {
+    table[i] = std::exp(-0.5f * (i - 255) * (i - 255) / 100.0f);
+  }
+  std::vector<int> lengths;
+  for (int length=1; length<32; length++) {
+    lengths.push_back(length);
+  }
+  for (int length=32; length<=64; length+=8) {
+    lengths.push_back(length);
+  }
+
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> value(0.0f, 1.0f);
+  std::uniform_int_distribution<int> byte(0, 255), offset(0, 7);
+  const int kMaxLength = 64 + 8;
+  std::vector<float> depth(kMaxLength), kernel(kMaxLength);
+  std::vector<uint8_t> rgb(3 * kMaxLength);
+  for (size_t k=0; k<kernels.size(); k++) {
+    int checked = 0;
+    for (int length : lengths) {
+      for (int trial=0; trial<20; trial++) {
+        WindowSums expected = {}, sums = {};
+        uint8_t center[3] = {static_cast<uint8_t>(byte(random)),
+                             static_cast<uint8_t>(byte(random)),
+                             static_cast<uint8_t>(byte(random))};
+        for (int row=0; row<2; row++) {
+          for (int j=0; j<kMaxLength; j++) {
+            // about a third of the taps missing
+            depth[j] = value(random) < 0.33f ? 0 : 500 + 2000 * value(random);
+            kernel[j] = value(random);
+            for (int c=0; c<3; c++) {
+              rgb[3 * j + c] = static_cast<uint8_t>(byte(random));
+            }
+          }
+          const int start = offset(random);
+          AccumulateRowScalar(&depth[start], &rgb[3 * start], &kernel[start],
+                              center, &table[255], length, &expected);
+          kernels[k](&depth[start], &rgb[3 * start], &kernel[start],
+                     center, &table[255], length, &sums);
+        }
+        EXPECT(expected.count == sums.count);
+        EXPECT(std::memcmp(expected.values, sums.values,
+                           sizeof(sums.values)) == 0);
+        EXPECT(std::memcmp(expected.weights, sums.weights,
+                           sizeof(sums.weights)) == 0);
+        checked++;
+      }
+    }
+    std::printf("row kernel %s: %d rows checked against the scalar kernel\n",
+                names[k], checked);
+  }
+}
+
+/* Inclusive 2D prefix sums of one term per pixel, in double precision. */
+class DoubleIntegral {
+  public:
+  DoubleIntegral(int rows, int cols)
+    : cols_(cols), sums_((rows + 1) * (cols + 1), 0.0) {}
+
+  void Set(int x, int y, double value) {
+    sums_[(y + 1) * (cols_ + 1) + x + 1] = value;
+  }
+  void Integrate(int rows) {
+    for (int y=1; y<=rows; y++) {
+      for (int x=1; x<=cols_; x++) {
+        At(x, y) += At(x - 1, y) + At(x, y - 1) - At(x - 1, y - 1);
+      }
+    }
+  }
+  // sum over columns [left, right) and rows [top, bottom)
+  double Sum(int left, int top, int right, int bottom) const {
+    return At(right, bottom) - At(left, bottom) - At(right, top)
+           + At(left, top);
+  }
+
+  private:
+  double &At(int x, int y) { return sums_[y * (cols_ + 1) + x]; }
+  double At(int x, int y) const { return sums_[y * (cols_ + 1) + x]; }
+
+  int cols_;
+  std::vector<double> sums_;
+};
+
+/* The 3-channel guided filter computed entirely in double precision, with
+ * the windows clipped at the border and normalized like GuidedFilter3. */
+static cv::Mat doubleGuidedFilter3(const cv::Mat &object, const cv::Mat &rgb,
+                                   int windowSize, double epsilon) {
+  const int rows = object.rows, cols = object.cols;
+  const int radius = windowSize / 2;
+  // I, I_i I_j for i <= j, p, I p
+  std::vector<DoubleIntegral> terms(13, DoubleIntegral(rows, cols));
+  for (int y=0; y<rows; y++) {
+    for (int x=0; x<cols; x++) {
+      const cv::Vec3b &I = rgb.at<cv::Vec3b>(y, x);
+      double p = object.at<float>(y, x);
+      int k = 3;
+      for (int i=0; i<3; i++) {
+        terms[i].Set(x, y, I[i]);
+        for (int j=i; j<3; j++) {
+          terms[k++].Set(x, y, double(I[i]) * I[j]);
+        }
+        terms[10 + i].Set(x, y, I[i] * p);
+      }
+      terms[9].Set(x, y, p);
+    }
+  }
+  for (DoubleIntegral &term : terms) {
+    term.Integrate(rows);
+  }
+
+  auto window = [&](int x, int y, int *left, int *top, int *right,
+                    int *bottom) {
+    *left = std::max(0, x - radius);
+    *top = std::max(0, y - radius);
+    *right = std::min(cols, x + radius + 1);
+    *bottom = std::min(rows, y + radius + 1);
+    return (*right - *left) * (*bottom - *top);
+  };
+  // A, then B
+  std::vector<DoubleIntegral> coefficients(4, DoubleIntegral(rows, cols));
+  for (int y=0; y<rows; y++) {
+    for (int x=0; x<cols; x++) {
+      int l, t, r, b;
+      double n = window(x, y, &l, &t, &r, &b);
+      Eigen::Vector3d mean, objref;
+      for (int i=0; i<3; i++) {
+        mean(i) = terms[i].Sum(l, t, r, b) / n;
+        objref(i) = terms[10 + i].Sum(l, t, r, b) / n;
+      }
+      double objectMean = terms[9].Sum(l, t, r, b) / n;
+      Eigen::Matrix3d covariance;
+      int k = 3;
+      for (int i=0; i<3; i++) {
+        for (int j=i; j<3; j++) {
+          covariance(i, j) = covariance(j, i) =
+              (terms[k++].Sum(l, t, r, b) - n * mean(i) * mean(j)) / (n - 1);
+        }
+        covariance(i, i) += epsilon;
+      }
+      Eigen::Vector3d a = covariance.ldlt().solve(objref - mean * objectMean);
+      for (int i=0; i<3; i++) {
+        coefficients[i].Set(x, y, a(i));
+      }
+      coefficients[3].Set(x, y, objectMean - a.dot(mean));
+    }
+  }
+  for (DoubleIntegral &coefficient : coefficients) {
+    coefficient.Integrate(rows);
+  }
+
+  cv::Mat result(rows, cols, CV_32F);
+  for (int y=0; y<rows; y++) {
+    for (int x=0; x<cols; x++) {
+      int l, t, r, b;
+      double n = window(x, y, &l, &t, &r, &b);
+      const cv::Vec3b &I = rgb.at<cv::Vec3b>(y, x);
+      double q = coefficients[3].Sum(l, t, r, b) / n;
+      for (int i=0; i<3; i++) {
+        q += coefficients[i].Sum(l, t, r, b) / n * I[i];
+      }
+      result.at<float>(y, x) = static_cast<float>(q);
+    }
+  }
+  return result;
+}
+
+/* Every precision of the integral-image engine against a filter computed
+ * entirely in double precision, over the whole image, within the error
+ * documented for it in GuidedFilterOptions::Precision. */
+void test_guided_filter_precision() {
+  cv::Mat dep, rgb, depF;
+  syntheticFrame(480, 640, &dep, &rgb);
+  dep.convertTo(depF, CV_32F);
+  struct Budget {
+    GuidedFilterOptions::Precision precision;
+    double bound;
+  };
+  for (int windowSize : {5, 11, 21}) {
+    for (float epsilon : {1.0f, 10.0f, 100.0f}) {
+      cv::Mat truth = doubleGuidedFilter3(depF, rgb, windowSize, epsilon);
+      for (const Budget &budget :
+           {Budget{GuidedFilterOptions::kDoublePrecision, 0.012},
+            Budget{GuidedFilterOptions::kFloatPrecision, 0.16},
+            Budget{GuidedFilterOptions::kCompensatedPrecision, 0.03}}) {
+        GuidedFilterOptions options;
+        options.precision = budget.precision;
+        cv::Mat result = GuidedFilter(depF, rgb, nullptr, windowSize,
+                                      epsilon, options);
+        double difference = cv::norm(truth, result, cv::NORM_INF);
+        std::printf("guided filter precision %d, window %d, epsilon %g: "
+                    "difference %g\n", budget.precision, windowSize, epsilon,
+                    difference);
+        EXPECT(difference < budget.bound);
+      }
+    }
+  }
+}
+
+/* The box-sum engine against the integral-image engine, for 1- and
+ * 3-channel references, on a small frame and on a 1080p frame in one band;
+ * see BoxGuidedFilter. */
+void test_box_guided_filter() {
+  struct Case {
+    int rows, cols, numThreads;
+    double bound;
+  };
+  for (const Case &size : {Case{150, 200, 1, 0.015},
+                           Case{1080, 1920, 1, 0.03}}) {
+    cv::Mat dep, rgb, gray, depF;
+    syntheticFrame(size.rows, size.cols, &dep, &rgb);
+    dep.convertTo(depF, CV_32F);
+    cv::cvtColor(rgb, gray, cv::COLOR_BGR2GRAY);
+    for (const cv::Mat &reference : {gray, rgb}) {
+      for (int windowSize : {3, 7, 15}) {
+        for (float epsilon : {10.0f, 100.0f}) {
+          GuidedFilterOptions options;
+          cv::Mat integral = GuidedFilter(depF, reference, nullptr,
+                                          windowSize, epsilon, options);
+          options.engine = GuidedFilterOptions::kBoxFilterEngine;
+          options.numThreads = size.numThreads;
+          cv::Mat box = GuidedFilter(depF, reference, nullptr, windowSize,
+                                     epsilon, options);
+          double difference = cv::norm(integral, box, cv::NORM_INF);
+          std::printf("box guided filter, %dx%d in %d bands, %d channels, "
+                      "window %d, epsilon %g: difference %g\n",
+                      size.cols, size.rows, size.numThreads,
+                      reference.channels(), windowSize, epsilon, difference);
+          EXPECT(difference < size.bound);
+        }
+      }
+    }
+  }
+}
+
+/* Tiled marches against the serial march, within the deviation
+ * documented in GDFMM::SetTiling. */
+void test_tiling() {
+  cv::Mat dep, rgb;
+  syntheticFrame(200, 260, &dep, &rgb);
+  punchHoles(40, &dep);
+  GDFMM serial;
+  cv::Mat expected = serial.InPaint(dep, rgb);
+  for (int tileSize : {40, 64, 100}) {
+    GDFMM tiled;
+    tiled.SetTiling(tileSize, 4);
+    Workspace workspace;
+    cv::Mat result;
+    // the second frame reuses the tile workspaces of the first
+    for (int frame=0; frame<2; frame++) {
+      tiled.InPaint(dep, rgb, &result, &workspace);
+      int filled = 0, changed = 0;
+      double worst = 0;
+      for (int y=0; y<dep.rows; y++) {
+        for (int x=0; x<dep.cols; x++) {
+          if (dep.at<uint16_t>(y, x) != 0)
+            continue;
+          double difference = std::fabs(result.at<double>(y, x) -
+                                        expected.at<double>(y, x));
+          filled++;
+          changed += difference > 1;
+          worst = std::max(worst, difference);
+        }
+      }
+      std::printf("tiles of %d, frame %d: %d of %d filled pixels changed by "
+                  "more than 1, at most %g\n", tileSize, frame, changed,
+                  filled, worst);
+      EXPECT(changed <= 0.08 * filled);
+      EXPECT(worst <= 15);
+    }
+  }
+}
+
+/* WindowStatistics::Solve on windows whose normal equations are singular
+ * without regularization: a flat channel, and two equal channels. The
+ * depth is linear in the colors, so the prediction is exact. */
+void test_degenerate_regression() {
+  std::mt19937 random(1);
+  std::uniform_int_distribution<int> color(0, 255);
+  for (int kind=0; kind<2; kind++) {
+    double worst = 0;
+    for (int trial=0; trial<100; trial++) {
+      const int flat = color(random);
+      WindowStatistics::Sums window = WindowStatistics::Sums();
+      uint8_t pixel[3];
+      auto fill = [&] () {
+        pixel[0] = kind == 0 ? flat : color(random);
+        pixel[1] = kind == 0 ? color(random) : pixel[0];
+        pixel[2] = color(random);
+      };
+      auto depth = [&] () {
+        return 1000.0f + 2 * pixel[0] + 3 * pixel[1] - pixel[2];
+      };
+      for (int n=0; n<20 + trial; n++) {
+        fill();
+        WindowStatistics::Add(pixel, depth(), &window);
+      }
+      fill();
+      float prediction = WindowStatistics::Solve(window, pixel, 0);
+      worst = std::max(worst, std::fabs(double(prediction) - depth()));
+    }
+    std::printf("degenerate regression %s: difference %g\n",
+                kind == 0 ? "flat channel" : "equal channels", worst);
+    EXPECT(worst < 0.01);
+  }
+}
+
+/* PredictDepth2 truncates to the depth range of the window also when all
+ * of its depths are negative, as CV_32F inputs may be. */
+void test_negative_truncation() {
+  std::mt19937 random(3);
+  std::uniform_int_distribution<int> color(50, 255);
+  cv::Mat depth(21, 21, CV_32F), rgb(21, 21, CV_8UC3);
+  for (int y=0; y<21; y++) {
+    for (int x=0; x<21; x++) {
+      cv::Vec3b &pixel = rgb.at<cv::Vec3b>(y, x);
+      for (int c=0; c<3; c++) {
+        pixel[c] = color(random);
+      }
+      // -2041 to -2000
+      depth.at<float>(y, x) = -2000.0f - 0.2f * (pixel[0] - 50);
+    }
+  }
+  // extrapolates to -1990, above the known depths
+  depth.at<float>(10, 10) = 0;
+  rgb.at<cv::Vec3b>(10, 10)[0] = 0;
+
+  GDFMM gdfmm(2, 10, 1, 21);
+  float truncated = GDFMMInternals::PredictDepth2(gdfmm, depth, rgb, 10, 10,
+                                                  0, 1, 0);
+  float free = GDFMMInternals::PredictDepth2(gdfmm, depth, rgb, 10, 10,
+                                             0, 1, -1);
+  std::printf("negative depths: truncated %g, not truncated %g\n",
+              truncated, free);
+  EXPECT(std::fabs(truncated + 2000) < 0.01);
+  EXPECT(free > -1995);
+}
+
 void test_inpaint() {
   cv::Mat rgb = cv::imread("/home/daniel/littlechair/0134_color.png", CV_LOAD_IMAGE_UNCHANGED);
   cv::Mat dep = cv::imread("/home/daniel/littlechair/0133_depth.png", CV_LOAD_IMAGE_UNCHANGED);
@@ -41,7 +451,25 @@ void test_guided_filter() {
   cv::waitKey(0);
 }
 
-int main() {
-  test_inpaint();
+/* Runs the checks; with --interactive, then shows the results of the
+ * demos, which need the littlechair images. */
+int main(int argc, char **argv) {
+  test_row_kernels();
+  test_guided_filter_precision();
+  test_box_guided_filter();
+  test_degenerate_regression();
+  test_tiling();
+  test_negative_truncation();
+
+  if (argc > 1 && std::strcmp(argv[1], "--interactive") == 0) {
+    test_inpaint();
+    test_guided_filter();
+  }
+
+  if (failures > 0) {
+    std::printf("%d checks failed\n", failures);
+    return 1;
+  }
+  return 0;
 }
 
@@ -0,0 +1,181 @@
+#include "gdfmm/umat.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <vector>
+
+namespace gdfmm {
+
+/* Every step is one OpenCV call on cv::UMat, so that the transparent API
+ * can run it as an OpenCL kernel; nothing is mapped to the host. */
+
+// Means over the part of every window inside the image, like meanAt in
+// guided_filter.cc.
+class WindowMean {
+  public:
+  WindowMean(cv::Size size, int windowSize)
+    : window_(windowSize, windowSize) {
+    cv::UMat ones(size, CV_32F, cv::Scalar(1));
+    Sum(ones, &count_);
+    cv::UMat countLess1;
+    count_.convertTo(countLess1, CV_32F, 1, -1);
+    cv::divide(count_, countLess1, unbiased_);
+  }
+
+  cv::UMat operator()(const cv::UMat &image) const {
+    cv::UMat mean;
+    Sum(image, &mean);
+    cv::divide(mean, count_, mean);
+    return mean;
+  }
+
+  // n / (n - 1) of every window, which turns a variance over n into the
+  // one over n - 1 of the 3-channel GuidedFilter
+  const cv::UMat &Unbiased() const { return unbiased_; }
+
+  private:
+  void Sum(const cv::UMat &image, cv::UMat *sum) const {
+    cv::boxFilter(image, *sum, CV_32F, window_, cv::Point(-1, -1), false,
+                  cv::BORDER_CONSTANT);
+  }
+
+  cv::Size window_;
+  cv::UMat count_, unbiased_;
+};
+
+static cv::UMat Product(const cv::UMat &a, const cv::UMat &b) {
+  cv::UMat product;
+  cv::multiply(a, b, product);
+  return product;
+}
+
+// a * b - c * d
+static cv::UMat Cross(const cv::UMat &a, const cv::UMat &b,
+                      const cv::UMat &c, const cv::UMat &d) {
+  cv::UMat cross;
+  cv::subtract(Product(a, b), Product(c, d), cross);
+  return cross;
+}
+
+// The channels of `image` in CV_32F, minus their means. Covariances are
+// shift invariant, so centring only changes rounding.
+static std::vector<cv::UMat> Centred(const cv::UMat &image, cv::Scalar *means) {
+  std::vector<cv::UMat> channels;
+  cv::split(image, channels);
+  *means = cv::mean(image);
+  for (size_t c=0; c<channels.size(); c++) {
+    channels[c].convertTo(channels[c], CV_32F, 1, -(*means)[c]);
+  }
+  return channels;
+}
+
+cv::UMat GuidedFilter(const cv::UMat &object,
+                      const cv::UMat &reference,
+                      cv::UMat *output,
+                      int windowSize,
+                      float epsilon) {
+  if (object.size() != reference.size()) {
+    throw "Images have different size";
+  }
+  if (object.channels() != 1) {
+    throw "Wrong number of channels";
+  }
+  if (reference.channels() != 1 && reference.channels() != 3) {
+    throw "Wrong number of channels";
+  }
+
+  WindowMean mean(object.size(), windowSize);
+  cv::Scalar objectMean, referenceMean;
+  cv::UMat p = Centred(object, &objectMean)[0];
+  std::vector<cv::UMat> I = Centred(reference, &referenceMean);
+  const int channels = static_cast<int>(I.size());
+
+  std::vector<cv::UMat> meanI(channels), cov(channels);
+  cv::UMat meanP = mean(p);
+  for (int c=0; c<channels; c++) {
+    meanI[c] = mean(I[c]);
+    cv::subtract(mean(Product(I[c], p)), Product(meanI[c], meanP), cov[c]);
+  }
+  // variance[i][j] for i <= j, regularized on the diagonal; normalized
+  // like the CPU filters, over n for 1 channel and n - 1 for 3
+  cv::UMat variance[3][3];
+  for (int i=0; i<channels; i++) {
+    for (int j=i; j<channels; j++) {
+      cv::subtract(mean(Product(I[i], I[j])), Product(meanI[i], meanI[j]),
+                   variance[i][j]);
+      if (channels == 3) {
+        cv::multiply(variance[i][j], mean.Unbiased(), variance[i][j]);
+      }
+      if (i == j) {
+        variance[i][j].convertTo(variance[i][j], CV_32F, 1, epsilon);
+      }
+    }
+  }
+
+  // A solves variance . A = cov in every window; B = mean(p) - A . mean(I)
+  std::vector<cv::UMat> A(channels);
+  cv::UMat B;
+  if (channels == 3) {
+    cv::UMat (&v)[3][3] = variance;
+    // cofactors of the symmetric matrix, symmetric themselves
+    cv::UMat c00 = Cross(v[1][1], v[2][2], v[1][2], v[1][2]);
+    cv::UMat c01 = Cross(v[0][2], v[1][2], v[0][1], v[2][2]);
+    cv::UMat c02 = Cross(v[0][1], v[1][2], v[0][2], v[1][1]);
+    cv::UMat c11 = Cross(v[0][0], v[2][2], v[0][2], v[0][2]);
+    cv::UMat c12 = Cross(v[0][1], v[0][2], v[0][0], v[1][2]);
+    cv::UMat c22 = Cross(v[0][0], v[1][1], v[0][1], v[0][1]);
+    const cv::UMat *cofactors[3][3] = {{&c00, &c01, &c02},
+                                       {&c01, &c11, &c12},
+                                       {&c02, &c12, &c22}};
+    cv::UMat determinant;
+    cv::add(Product(v[0][0], c00), Product(v[0][1], c01), determinant);
+    cv::add(determinant, Product(v[0][2], c02), determinant);
+    for (int c=0; c<3; c++) {
+      cv::add(Product(*cofactors[c][0], cov[0]),
+              Product(*cofactors[c][1], cov[1]), A[c]);
+      cv::add(A[c], Product(*cofactors[c][2], cov[2]), A[c]);
+      cv::divide(A[c], determinant, A[c]);
+    }
+  }
+  else {
+    cv::divide(cov[0], variance[0][0], A[0]);
+  }
+  B = meanP;
+  for (int c=0; c<channels; c++) {
+    cv::subtract(B, Product(A[c], meanI[c]), B);
+  }
+
+  // q = mean(A) . I + mean(B), back on the mean of the object
+  cv::UMat result = mean(B);
+  for (int c=0; c<channels; c++) {
+    cv::add(result, Product(mean(A[c]), I[c]), result);
+  }
+  cv::UMat image;
+  cv::UMat &out = output ? *output : image;
+  result.convertTo(out, object.depth(), 1, objectMean[0]);
+  return out;
+}
+
+void ComputeSpeedMap(const cv::UMat &rgbImage,
+                     float blurSigma,
+                     cv::UMat *speed) {
+  cv::UMat blurred;
+  cv::GaussianBlur(rgbImage, blurred, cv::Size(0, 0), blurSigma, blurSigma);
+
+  // squared Sobel gradients, summed over the channels
+  cv::UMat dx, dy, strength;
+  cv::Sobel(blurred, dx, CV_32F, 1, 0, 3);
+  cv::Sobel(blurred, dy, CV_32F, 0, 1, 3);
+  cv::add(Product(dx, dx), Product(dy, dy), strength);
+  std::vector<cv::UMat> channels;
+  cv::split(strength, channels);
+  for (size_t c=1; c<channels.size(); c++) {
+    cv::add(channels[0], channels[c], channels[0]);
+  }
+
+  // -1 / (1 + g)
+  channels[0].convertTo(channels[0], CV_32F, 1, 1);
+  cv::divide(-1.0, channels[0], *speed);
+}
+
+}  // namespace gdfmm
@@ -0,0 +1,110 @@
+#include "window_kernel.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+namespace gdfmm {
+
+void AccumulateRowScalar(const float *depth, const uint8_t *rgb,
+                         const float *kernel, const uint8_t *center,
+                         const float *colorTable, int length,
+                         WindowSums *sums) {
+  for (int j = 0; j < length; j++) {
+    float d = depth[j];
+    if (d == 0) // invalid
+      continue;
+
+    const uint8_t *c = rgb + 3 * j;
+    float weight = std::max((float)1e-6,
+        kernel[j] *
+        colorTable[(int)center[0] - (int)c[0]] *
+        colorTable[(int)center[1] - (int)c[1]] *
+        colorTable[(int)center[2] - (int)c[2]]);
+    int lane = j % kWindowLanes;
+    sums->values[lane] += weight * d;
+    sums->weights[lane] += weight;
+    sums->count++;
+  }
+}
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+void AccumulateRowNEON(const float *depth, const uint8_t *rgb,
+                       const float *kernel, const uint8_t *center,
+                       const float *colorTable, int length,
+                       WindowSums *sums) {
+  float32x4_t values[2] = { vld1q_f32(sums->values),
+                            vld1q_f32(sums->values + 4) };
+  float32x4_t weights[2] = { vld1q_f32(sums->weights),
+                             vld1q_f32(sums->weights + 4) };
+  const float32x4_t minWeight = vdupq_n_f32(1e-6f);
+  const float32x4_t zero = vdupq_n_f32(0);
+
+  for (int j = 0; j < length; j += kWindowLanes) {
+    // pad the tail with invalid taps
+    float depthChunk[kWindowLanes] = {0};
+    float kernelChunk[kWindowLanes] = {0};
+    uint8_t rgbChunk[3 * kWindowLanes] = {0};
+    int n = std::min(kWindowLanes, length - j);
+    std::memcpy(depthChunk, depth + j, n * sizeof(float));
+    std::memcpy(kernelChunk, kernel + j, n * sizeof(float));
+    std::memcpy(rgbChunk, rgb + 3 * j, 3 * n);
+
+    // deinterleave and look up the color weights; NEON has no gather
+    uint8x8x3_t c = vld3_u8(rgbChunk);
+    uint8_t channel[3][kWindowLanes];
+    vst1_u8(channel[0], c.val[0]);
+    vst1_u8(channel[1], c.val[1]);
+    vst1_u8(channel[2], c.val[2]);
+    float color[3][kWindowLanes];
+    for (int ch = 0; ch < 3; ch++) {
+      for (int k = 0; k < kWindowLanes; k++) {
+        color[ch][k] = colorTable[(int)center[ch] - (int)channel[ch][k]];
+      }
+    }
+
+    for (int half = 0; half < 2; half++) {
+      int o = 4 * half;
+      float32x4_t d = vld1q_f32(depthChunk + o);
+      uint32x4_t valid = vmvnq_u32(vceqq_f32(d, zero));
+      float32x4_t w = vld1q_f32(kernelChunk + o);
+      w = vmulq_f32(w, vld1q_f32(color[0] + o));
+      w = vmulq_f32(w, vld1q_f32(color[1] + o));
+      w = vmulq_f32(w, vld1q_f32(color[2] + o));
+      w = vmaxq_f32(w, minWeight);
+      float32x4_t wd = vmulq_f32(w, d);
+      values[half] = vaddq_f32(values[half], vreinterpretq_f32_u32(
+          vandq_u32(valid, vreinterpretq_u32_f32(wd))));
+      weights[half] = vaddq_f32(weights[half], vreinterpretq_f32_u32(
+          vandq_u32(valid, vreinterpretq_u32_f32(w))));
+      for (int k = 0; k < 4; k++) {
+        sums->count += depthChunk[o + k] != 0;
+      }
+    }
+  }
+
+  vst1q_f32(sums->values, values[0]);
+  vst1q_f32(sums->values + 4, values[1]);
+  vst1q_f32(sums->weights, weights[0]);
+  vst1q_f32(sums->weights + 4, weights[1]);
+}
+#endif
+
+AccumulateRowFn SelectAccumulateRow() {
+#ifdef GDFMM_HAVE_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return AccumulateRowAVX2;
+  }
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  return AccumulateRowNEON;
+#else
+  return AccumulateRowScalar;
+#endif
+}
+
+}  // namespace gdfmm
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+namespace gdfmm {
+
+/* Row kernels for the weighted window sum in GDFMM::PredictDepth.
+ *
+ * Every implementation accumulates tap j of a window row into lane
+ * j % kWindowLanes, multiplies in the same order and does not contract to
+ * FMA, so the scalar, AVX2 and NEON versions give bit-identical sums. */
+
+static const int kWindowLanes = 8;
+
+/** \brief Per-lane partial sums of one PredictDepth window. */
+struct WindowSums {
+  float values[kWindowLanes];
+  float weights[kWindowLanes];
+  int count;
+};
+
+/** \brief Accumulates one window row.
+ *
+ * Depth values of zero are skipped. For the remaining taps, the weight
+ * is max(1e-6, kernel[j] * colorTable[center - rgb] over the three
+ * channels), where `colorTable` points at the zero entry of a symmetric
+ * lookup table.
+ *
+ * @param[in] depth `length` depth values
+ * @param[in] rgb `length` interleaved 8-bit BGR/RGB pixels
+ * @param[in] kernel `length` spatial weights
+ * @param[in] center The color of the pixel being predicted
+ * */
+typedef void (*AccumulateRowFn)(const float *depth,
+                                const uint8_t *rgb,
+                                const float *kernel,
+                                const uint8_t *center,
+                                const float *colorTable,
+                                int length,
+                                WindowSums *sums);
+
+void AccumulateRowScalar(const float *depth, const uint8_t *rgb,
+                         const float *kernel, const uint8_t *center,
+                         const float *colorTable, int length,
+                         WindowSums *sums);
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+void AccumulateRowNEON(const float *depth, const uint8_t *rgb,
+                       const float *kernel, const uint8_t *center,
+                       const float *colorTable, int length,
+                       WindowSums *sums);
+#endif
+#ifdef GDFMM_HAVE_AVX2
+void AccumulateRowAVX2(const float *depth, const uint8_t *rgb,
+                       const float *kernel, const uint8_t *center,
+                       const float *colorTable, int length,
+                       WindowSums *sums);
+#endif
+
+/** \brief Scalar row kernel for guides with `kChannels` interleaved 8-bit
+ * channels.
+ *
+ * Same taps, products and lanes as AccumulateRowScalar. A positive
+ * `kLength` fixes the row length at compile time so that the loop can be
+ * unrolled, and `length` is ignored; 0 reads `length`.
+ * */
+template <int kChannels, int kLength>
+inline void AccumulateRowFixed(const float *depth, const uint8_t *guide,
+                               const float *kernel, const uint8_t *center,
+                               const float *colorTable, int length,
+                               WindowSums *sums) {
+  const int n = kLength > 0 ? kLength : length;
+  for (int j = 0; j < n; j++) {
+    float d = depth[j];
+    if (d == 0) // invalid
+      continue;
+
+    const uint8_t *c = guide + kChannels * j;
+    float weight = kernel[j];
+    for (int ch = 0; ch < kChannels; ch++) {
+      weight *= colorTable[(int)center[ch] - (int)c[ch]];
+    }
+    weight = std::max((float)1e-6, weight);
+    int lane = j % kWindowLanes;
+    sums->values[lane] += weight * d;
+    sums->weights[lane] += weight;
+    sums->count++;
+  }
+}
+
+/** \brief Picks the fastest row kernel supported by the running CPU. */
+AccumulateRowFn SelectAccumulateRow();
+
+/** \brief Sums the lanes in a fixed order. */
+inline float ReduceLanes(const float lanes[kWindowLanes]) {
+  return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+         ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+}  // namespace gdfmm
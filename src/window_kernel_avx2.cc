@@ -0,0 +1,83 @@
+// Compiled with -mavx2; only called after a runtime CPU check.
+#include "window_kernel.h"
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstring>
+
+namespace gdfmm {
+
+// Extracts channel `c` of 8 interleaved pixels held in 16 + 8 bytes.
+static inline __m256i Channel(__m128i lo, __m128i hi, int c) {
+  static const int8_t kLo[3][16] = {
+    {0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}};
+  static const int8_t kHi[3][16] = {
+    {-1, -1, -1, -1, -1, -1, 2, 5, -1, -1, -1, -1, -1, -1, -1, -1},
+    {-1, -1, -1, -1, -1, 0, 3, 6, -1, -1, -1, -1, -1, -1, -1, -1},
+    {-1, -1, -1, -1, -1, 1, 4, 7, -1, -1, -1, -1, -1, -1, -1, -1}};
+  __m128i bytes = _mm_or_si128(
+      _mm_shuffle_epi8(lo, _mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(kLo[c]))),
+      _mm_shuffle_epi8(hi, _mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(kHi[c]))));
+  return _mm256_cvtepu8_epi32(bytes);
+}
+
+void AccumulateRowAVX2(const float *depth, const uint8_t *rgb,
+                       const float *kernel, const uint8_t *center,
+                       const float *colorTable, int length,
+                       WindowSums *sums) {
+  __m256 values = _mm256_loadu_ps(sums->values);
+  __m256 weights = _mm256_loadu_ps(sums->weights);
+  const __m256 minWeight = _mm256_set1_ps(1e-6f);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256i centerColor[3] = { _mm256_set1_epi32(center[0]),
+                                   _mm256_set1_epi32(center[1]),
+                                   _mm256_set1_epi32(center[2]) };
+
+  for (int j = 0; j < length; j += kWindowLanes) {
+    const float *depthChunk = depth + j;
+    const float *kernelChunk = kernel + j;
+    const uint8_t *rgbChunk = rgb + 3 * j;
+
+    // pad the tail with invalid taps, so that no load crosses the row end
+    float depthTail[kWindowLanes] = {0};
+    float kernelTail[kWindowLanes] = {0};
+    uint8_t rgbTail[3 * kWindowLanes] = {0};
+    int n = length - j;
+    if (n < kWindowLanes) {
+      std::memcpy(depthTail, depthChunk, n * sizeof(float));
+      std::memcpy(kernelTail, kernelChunk, n * sizeof(float));
+      std::memcpy(rgbTail, rgbChunk, 3 * n);
+      depthChunk = depthTail;
+      kernelChunk = kernelTail;
+      rgbChunk = rgbTail;
+    }
+
+    __m256 d = _mm256_loadu_ps(depthChunk);
+    __m256 valid = _mm256_cmp_ps(d, zero, _CMP_NEQ_UQ);
+
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rgbChunk));
+    __m128i hi = _mm_loadl_epi64(
+        reinterpret_cast<const __m128i *>(rgbChunk + 16));
+
+    __m256 w = _mm256_loadu_ps(kernelChunk);
+    for (int c = 0; c < 3; c++) {
+      __m256i diff = _mm256_sub_epi32(centerColor[c], Channel(lo, hi, c));
+      w = _mm256_mul_ps(w, _mm256_i32gather_ps(colorTable, diff, 4));
+    }
+    w = _mm256_max_ps(w, minWeight);
+
+    values = _mm256_add_ps(values,
+                           _mm256_and_ps(valid, _mm256_mul_ps(w, d)));
+    weights = _mm256_add_ps(weights, _mm256_and_ps(valid, w));
+    sums->count += __builtin_popcount(_mm256_movemask_ps(valid));
+  }
+
+  _mm256_storeu_ps(sums->values, values);
+  _mm256_storeu_ps(sums->weights, weights);
+}
+
+}  // namespace gdfmm
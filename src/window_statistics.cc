@@ -0,0 +1,270 @@
+#include "window_statistics.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <eigen3/Eigen/Eigen>
+
+namespace gdfmm {
+
+// layout of Sums::terms
+enum {
+  kSumI = 0,     // 3 entries
+  kSumII = 3,    // rr, rg, rb, gg, gb, bb
+  kSumD = 9,
+  kSumID = 10    // 3 entries
+};
+
+// index into the upper triangle at kSumII
+static inline int ProductIndex(int i, int j) {
+  static const int index[3][3] = {{0, 1, 2}, {1, 3, 4}, {2, 4, 5}};
+  return kSumII + index[i][j];
+}
+
+WindowStatistics::WindowStatistics()
+  : windowSize_(0), rows_(0), cols_(0) {}
+
+void WindowStatistics::Contribution(const uint8_t *color, float depth,
+                                    double terms[kTerms]) {
+  for (int i=0; i<3; i++) {
+    terms[kSumI + i] = color[i];
+    for (int j=i; j<3; j++) {
+      terms[ProductIndex(i, j)] = static_cast<double>(color[i]) * color[j];
+    }
+    terms[kSumID + i] = static_cast<double>(color[i]) * depth;
+  }
+  terms[kSumD] = depth;
+}
+
+void WindowStatistics::Add(const uint8_t *color, float depth,
+                           Sums *window) {
+  double *terms = window->terms;
+  for (int i=0; i<3; i++) {
+    terms[kSumI + i] += color[i];
+    for (int j=i; j<3; j++) {
+      terms[ProductIndex(i, j)] += static_cast<double>(color[i]) * color[j];
+    }
+    terms[kSumID + i] += static_cast<double>(color[i]) * depth;
+  }
+  terms[kSumD] += depth;
+  window->count++;
+}
+
+void WindowStatistics::Init(const cv::Mat &depthImage,
+                            const cv::Mat &rgbImage,
+                            int windowSize) {
+  assert(depthImage.depth() == CV_32F);
+  assert(rgbImage.depth() == CV_8U && rgbImage.channels() == 3);
+  windowSize_ = windowSize;
+  rows_ = depthImage.rows;
+  cols_ = depthImage.cols;
+  int windowRadius = windowSize_ / 2;
+
+  slot_.assign(rows_ * cols_, -1);
+  sums_.clear();
+  for (int y=0; y<rows_; y++) {
+    const float *depthRow = depthImage.ptr<float>(y);
+    for (int x=0; x<cols_; x++) {
+      if (depthRow[x] == 0) {
+        slot_[y * cols_ + x] = static_cast<int>(sums_.size());
+        sums_.push_back(Sums());
+      }
+    }
+  }
+
+  // Sliding window: column sums over the rows of the window, then a
+  // running sum over those columns.
+  std::vector<Sums> &columns = columns_;
+  columns.assign(cols_, Sums());
+  double terms[kTerms];
+  auto accumulateRow = [&](int y, int sign) {
+    const float *depthRow = depthImage.ptr<float>(y);
+    const uint8_t *rgbRow = rgbImage.ptr<uint8_t>(y);
+    for (int x=0; x<cols_; x++) {
+      if (depthRow[x] == 0)
+        continue;
+      Contribution(rgbRow + 3 * x, depthRow[x], terms);
+      columns[x].count += sign;
+      for (int k=0; k<kTerms; k++) {
+        columns[x].terms[k] += sign * terms[k];
+      }
+    }
+  };
+  auto accumulateColumn = [&](Sums *window, int x, int sign) {
+    window->count += sign * columns[x].count;
+    for (int k=0; k<kTerms; k++) {
+      window->terms[k] += sign * columns[x].terms[k];
+    }
+  };
+
+  for (int y=0; y<std::min(windowRadius, rows_); y++) {
+    accumulateRow(y, 1);
+  }
+  for (int y=0; y<rows_; y++) {
+    if (y + windowRadius < rows_)
+      accumulateRow(y + windowRadius, 1);
+    if (y - windowRadius - 1 >= 0)
+      accumulateRow(y - windowRadius - 1, -1);
+
+    Sums window = Sums();
+    for (int x=0; x<std::min(windowRadius, cols_); x++) {
+      accumulateColumn(&window, x, 1);
+    }
+    for (int x=0; x<cols_; x++) {
+      if (x + windowRadius < cols_)
+        accumulateColumn(&window, x + windowRadius, 1);
+      if (x - windowRadius - 1 >= 0)
+        accumulateColumn(&window, x - windowRadius - 1, -1);
+
+      int slot = slot_[y * cols_ + x];
+      if (slot >= 0) {
+        sums_[slot] = window;
+      }
+    }
+  }
+}
+
+void WindowStatistics::Add(const cv::Mat &rgbImage, int x, int y,
+                           float depth) {
+  int windowRadius = windowSize_ / 2;
+  double terms[kTerms];
+  Contribution(rgbImage.ptr<uint8_t>(y) + 3 * x, depth, terms);
+
+  // (x, y) no longer needs statistics of its own
+  slot_[y * cols_ + x] = -1;
+
+  for (int n = std::max(0, y - windowRadius);
+       n <= std::min(rows_ - 1, y + windowRadius);
+       n++) {
+    const int *slotRow = &slot_[n * cols_];
+    for (int m = std::max(0, x - windowRadius);
+         m <= std::min(cols_ - 1, x + windowRadius);
+         m++) {
+      if (slotRow[m] < 0)
+        continue;
+      Sums &window = sums_[slotRow[m]];
+      window.count++;
+      for (int k=0; k<kTerms; k++) {
+        window.terms[k] += terms[k];
+      }
+    }
+  }
+}
+
+int WindowStatistics::Count(int x, int y) const {
+  int slot = slot_[y * cols_ + x];
+  return slot < 0 ? 0 : sums_[slot].count;
+}
+
+float WindowStatistics::Predict(const cv::Mat &rgbImage,
+                                int x, int y,
+                                float epsilon,
+                                float constant) const {
+  int slot = slot_[y * cols_ + x];
+  assert(slot >= 0);
+  (void)constant;  // drops out, see Solve
+  return Solve(sums_[slot], rgbImage.ptr<uint8_t>(y) + 3 * x, epsilon);
+}
+
+// Pivots at or below this fraction of the largest diagonal entry of the
+// normal equations are taken as zero.
+static const double kPivotTolerance = 1e-9;
+
+/* x with a . x = b for a symmetric positive definite 3x3 a, by a
+ * closed-form LDL^T decomposition. Returns false, leaving x unset, if a
+ * pivot is not clearly positive, as for a flat channel or two collinear
+ * channels with no regularization. */
+static bool SolveSymmetric(const Eigen::Matrix3d &a,
+                           const Eigen::Vector3d &b,
+                           Eigen::Vector3d *x) {
+  const double tolerance =
+      kPivotTolerance * a.diagonal().cwiseAbs().maxCoeff();
+  const double d0 = a(0, 0);
+  if (!(d0 > tolerance))
+    return false;
+  const double l10 = a(1, 0) / d0;
+  const double l20 = a(2, 0) / d0;
+  const double d1 = a(1, 1) - l10 * l10 * d0;
+  if (!(d1 > tolerance))
+    return false;
+  const double l21 = (a(2, 1) - l20 * l10 * d0) / d1;
+  const double d2 = a(2, 2) - l20 * l20 * d0 - l21 * l21 * d1;
+  if (!(d2 > tolerance))
+    return false;
+
+  // L z = b, then L^T x = D^-1 z
+  const double z0 = b(0);
+  const double z1 = b(1) - l10 * z0;
+  const double z2 = b(2) - l20 * z0 - l21 * z1;
+  const double x2 = z2 / d2;
+  const double x1 = z1 / d1 - l21 * x2;
+  const double x0 = z0 / d0 - l10 * x1 - l20 * x2;
+  *x = Eigen::Vector3d(x0, x1, x2);
+  return true;
+}
+
+/* The same for a semi-definite a, by Eigen's pivoted LDLT. Directions
+ * whose pivot vanishes are left out of the solution. Eigen only drops
+ * pivots that are exactly zero, but the window sums leave rounding noise
+ * in a flat channel, which the standardization then scales up. */
+static Eigen::Vector3d SolveSemiDefinite(const Eigen::Matrix3d &a,
+                                         const Eigen::Vector3d &b) {
+  const Eigen::LDLT<Eigen::Matrix3d> ldlt(a);
+  const Eigen::Vector3d d = ldlt.vectorD();
+  const double tolerance = kPivotTolerance * d.cwiseAbs().maxCoeff();
+  Eigen::Vector3d x = ldlt.transpositionsP() * b;
+  ldlt.matrixL().solveInPlace(x);
+  for (int i=0; i<3; i++) {
+    x(i) = d(i) > tolerance ? x(i) / d(i) : 0;
+  }
+  ldlt.matrixU().solveInPlace(x);
+  return ldlt.transpositionsP().transpose() * x;
+}
+
+float WindowStatistics::Solve(const Sums &window,
+                              const uint8_t *color,
+                              float epsilon) {
+  if (window.count <= 3) {
+    return 0;
+  }
+
+  // Normal equations of PredictDepth2's standardized regression, written
+  // in terms of the window sums. The constant column is orthogonal to the
+  // centred colors and depths, so its coefficient is 0 whatever the
+  // constant, which leaves a 3x3 system.
+  double n = window.count;
+  Eigen::Vector3d mean, stddev;
+  for (int i=0; i<3; i++) {
+    mean(i) = window.terms[kSumI + i] / n;
+    double variance = window.terms[ProductIndex(i, i)] / n - mean(i) * mean(i);
+    stddev(i) = std::max(std::sqrt(std::max(variance, 0.0)), 0.00001);
+  }
+  double meanDepth = window.terms[kSumD] / n;
+
+  Eigen::Matrix3d cov;
+  Eigen::Vector3d xy;
+  for (int i=0; i<3; i++) {
+    for (int j=0; j<3; j++) {
+      cov(i, j) = (window.terms[ProductIndex(i, j)] - n * mean(i) * mean(j))
+                  / (stddev(i) * stddev(j));
+    }
+    cov(i, i) += epsilon;
+    xy(i) = (window.terms[kSumID + i] - n * mean(i) * meanDepth) / stddev(i);
+  }
+
+  Eigen::Vector3d beta;
+  if (!SolveSymmetric(cov, xy, &beta)) {
+    beta = SolveSemiDefinite(cov, xy);
+  }
+
+  Eigen::Vector3d test;
+  for (int i=0; i<3; i++) {
+    test(i) = (color[i] - mean(i)) / stddev(i);
+  }
+
+  float prediction = static_cast<float>(beta.dot(test) + meanDepth);
+  assert(!std::isnan(prediction));
+  return prediction;
+}
+
+}  // namespace gdfmm
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+namespace gdfmm {
+
+/** \brief Running sufficient statistics of the windows around missing
+ * pixels, for the regression in GDFMM::InPaint2.
+ *
+ * For every missing pixel we keep, over the known pixels of its window,
+ * the count, \f$\sum I\f$, \f$\sum II^T\f$, \f$\sum D\f$ and
+ * \f$\sum ID\f$, where \f$I\f$ is the 3-channel color and \f$D\f$ the depth.
+ * The statistics are built in one sliding-window pass and then updated
+ * whenever the march fills a pixel, so a prediction is a constant-time
+ * 4x4 solve instead of a window scan.
+ * */
+class WindowStatistics {
+  public:
+  WindowStatistics();
+
+  /** \brief Builds the statistics for all pixels whose depth is zero.
+   *
+   * Storage from earlier calls is reused.
+   *
+   * @param[in] depthImage CV_32F depth, zero where missing
+   * @param[in] rgbImage 8-bit, 3-channel reference image
+   * */
+  void Init(const cv::Mat &depthImage, const cv::Mat &rgbImage,
+            int windowSize);
+
+  /** \brief Records that pixel (x, y) is now known with depth `depth`. */
+  void Add(const cv::Mat &rgbImage, int x, int y, float depth);
+
+  /** \brief Number of known pixels in the window of missing pixel (x, y). */
+  int Count(int x, int y) const;
+
+  /** \brief Same prediction as GDFMM::PredictDepth2, from the statistics. */
+  float Predict(const cv::Mat &rgbImage,
+                int x, int y,
+                float epsilon,
+                float constant) const;
+
+  // 3 color sums, 6 unique color products, depth sum, 3 color-depth sums
+  static const int kTerms = 13;
+  struct Sums {
+    int count;
+    double terms[kTerms];
+  };
+
+  /** \brief Adds a known pixel to the sums of a window. */
+  static void Add(const uint8_t *color, float depth, Sums *window);
+
+  /** \brief The regression of GDFMM::PredictDepth2 at a pixel of color
+   * `color`, from the sums over its window; 0 with 3 or fewer known pixels.
+   * */
+  static float Solve(const Sums &window,
+                     const uint8_t *color,
+                     float epsilon);
+
+  private:
+  static void Contribution(const uint8_t *color, float depth,
+                           double terms[kTerms]);
+
+  int windowSize_;
+  int rows_, cols_;
+  std::vector<Sums> columns_;
+  // index into sums_ for every missing pixel, -1 for known pixels
+  std::vector<int> slot_;
+  std::vector<Sums> sums_;
+};
+
+}  // namespace gdfmm
@@ -0,0 +1,14 @@
+#include "workspace.h"
+
+namespace gdfmm {
+
+Workspace::Workspace()
+  : buffers_(new Buffers) {}
+
+Workspace::~Workspace() {}
+
+const Stats &Workspace::stats() const {
+  return buffers_->stats;
+}
+
+}  // namespace gdfmm
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "gdfmm/gdfmm.h"
+#include "hole_groups.h"
+#include "narrow_band.h"
+#include "window_statistics.h"
+
+#include <opencv2/core/core.hpp>
+#include <memory>
+#include <vector>
+
+namespace gdfmm {
+
+/* Buffers of the integral-image guided filter. */
+struct GuidedFilterBuffers {
+  cv::Mat object, reference;
+  cv::Mat objectI, referenceI, objref, objrefI;
+  // products of reference channels i <= j at 3*i + j; [0] for 1 channel
+  cv::Mat reference2I[9];
+  cv::Mat A, B, AI, BI, result;
+};
+
+struct Workspace::Buffers {
+  // GDFMM::InPaintBase
+  cv::Mat depth;
+  cv::Mat blurred, speed;
+  // set by GDFMM::Prepare: `depth` and `speed` hold the next frame
+  bool prepared = false;
+  // tiled or grouped march result
+  cv::Mat tiled;
+  HoleGroups holes;
+  // GDFMM::SetTiling: one workspace per tile, whose region keeps its size
+  // from frame to frame
+  std::vector<std::unique_ptr<Workspace>> tileWorkspaces;
+  // GDFMM::SetHoleParallelism: one workspace per band of groups
+  std::vector<std::unique_ptr<Workspace>> groupWorkspaces;
+  // GDFMM::Enhance
+  cv::Mat filtered;
+  // GDFMM::InPaint with a region: non-zero where missing pixels are
+  // filled, empty otherwise; a view of `regionTarget`, which keeps its
+  // buffer between calls
+  cv::Mat target, regionTarget;
+  // GDFMM::SetPyramidLevels: the next coarser level, its reference and the
+  // upsampled result
+  std::unique_ptr<Workspace> coarser;
+  cv::Mat coarserRgb, upsampled;
+  HeapBand heapBand;
+  BucketBand bucketBand;
+#ifdef GDFMM_HAVE_OPENCL
+  // GDFMM::SetDeviceSpeedMap: the reference and speed map on the device
+  cv::UMat deviceRgb, deviceSpeed;
+#endif
+  // scheduling of the march: known pixels of every window, and the state
+  // of every pixel with a 1-pixel border (see Propagate)
+  cv::Mat knownI, knownCount, state;
+  // GDFMM::SetWavefront: the pixels of one step and their predictions
+  std::vector<uint32_t> wavefront;
+  std::vector<float> wavefrontDepths;
+  WindowStatistics statistics;
+  // GDFMM::SetDepthGradient: depth gradient of every pixel
+  cv::Mat depthGradient;
+
+  GuidedFilterBuffers guidedFilter;
+
+  // filled only in GDFMM_STATS builds
+  Stats stats;
+};
+
+}  // namespace gdfmm
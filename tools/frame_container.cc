@@ -0,0 +1,151 @@
+#include "frame_container.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace gdfmm {
+
+namespace {
+
+const char kMagic[8] = {'G', 'D', 'F', 'M', 'M', 'R', 'A', 'W'};
+const uint32_t kVersion = 1;
+const size_t kHeaderBytes = 64;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  int32_t frames, rows, cols, depthType, rgbType;
+};
+static_assert(sizeof(Header) <= kHeaderBytes, "header does not fit");
+
+std::runtime_error Error(const std::string &path, const std::string &what) {
+  return std::runtime_error(path + ": " + what);
+}
+
+size_t ImageBytes(cv::Size size, int type) {
+  return static_cast<size_t>(size.area()) * CV_ELEM_SIZE(type);
+}
+
+}  // namespace
+
+FrameContainer::FrameContainer()
+  : fd_(-1), data_(nullptr), bytes_(0), frames_(0),
+    depthType_(-1), rgbType_(-1) {}
+
+FrameContainer::~FrameContainer() {
+  Close();
+}
+
+void FrameContainer::Close() {
+  if (data_) {
+    munmap(data_, bytes_);
+    data_ = nullptr;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+void FrameContainer::Map(size_t bytes, bool writable) {
+  int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  void *data = mmap(nullptr, bytes, protection, MAP_SHARED, fd_, 0);
+  if (data == MAP_FAILED) {
+    throw std::runtime_error(std::string("mmap: ") + std::strerror(errno));
+  }
+  data_ = static_cast<unsigned char *>(data);
+  bytes_ = bytes;
+}
+
+void FrameContainer::Open(const std::string &path) {
+  Close();
+  fd_ = open(path.c_str(), O_RDONLY);
+  struct stat status;
+  if (fd_ < 0 || fstat(fd_, &status) != 0) {
+    throw Error(path, std::strerror(errno));
+  }
+  Header header;
+  if (static_cast<size_t>(status.st_size) < kHeaderBytes ||
+      pread(fd_, &header, sizeof(header), 0) != sizeof(header) ||
+      std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+    throw Error(path, "not a frame container");
+  }
+  if (header.version != kVersion) {
+    throw Error(path, "unsupported container version");
+  }
+  frames_ = header.frames;
+  size_ = cv::Size(header.cols, header.rows);
+  depthType_ = header.depthType;
+  rgbType_ = header.rgbType;
+  if (frames_ < 0 || size_.width <= 0 || size_.height <= 0 ||
+      static_cast<size_t>(status.st_size) <
+          kHeaderBytes + frames_ * FrameBytes()) {
+    throw Error(path, "truncated frame container");
+  }
+  Map(static_cast<size_t>(status.st_size), false);
+  // the frames are mostly read in order
+  madvise(data_, bytes_, MADV_SEQUENTIAL);
+}
+
+void FrameContainer::Create(const std::string &path,
+                            int frames,
+                            cv::Size size,
+                            int depthType,
+                            int rgbType) {
+  Close();
+  frames_ = frames;
+  size_ = size;
+  depthType_ = depthType;
+  rgbType_ = rgbType;
+  const size_t bytes = kHeaderBytes + frames_ * FrameBytes();
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0 || ftruncate(fd_, static_cast<off_t>(bytes)) != 0) {
+    throw Error(path, std::strerror(errno));
+  }
+  Map(bytes, true);
+
+  Header header;
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.frames = frames;
+  header.rows = size.height;
+  header.cols = size.width;
+  header.depthType = depthType;
+  header.rgbType = rgbType;
+  std::memcpy(data_, &header, sizeof(header));
+}
+
+size_t FrameContainer::DepthBytes() const {
+  return ImageBytes(size_, depthType_);
+}
+
+size_t FrameContainer::FrameBytes() const {
+  return DepthBytes() + (hasReference() ? ImageBytes(size_, rgbType_) : 0);
+}
+
+unsigned char *FrameContainer::FrameData(int i) const {
+  assert(i >= 0 && i < frames_);
+  return data_ + kHeaderBytes + i * FrameBytes();
+}
+
+cv::Mat FrameContainer::Depth(int i) const {
+  return cv::Mat(size_.height, size_.width, depthType_, FrameData(i));
+}
+
+cv::Mat FrameContainer::Reference(int i) const {
+  if (!hasReference()) {
+    return cv::Mat();
+  }
+  return cv::Mat(size_.height, size_.width, rgbType_,
+                 FrameData(i) + DepthBytes());
+}
+
+}  // namespace gdfmm
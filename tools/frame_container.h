@@ -0,0 +1,72 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <cstddef>
+#include <string>
+
+namespace gdfmm {
+
+/** \brief A memory-mapped file of raw RGB-D frames, for gdfmm_batch.
+ *
+ * A 64-byte header is followed by frames of one fixed size: every frame
+ * is a depth image and, optionally, a reference image, row by row without
+ * padding. Frames are read and written in place in the mapping, so there
+ * is no decoding, and frame i is at a known offset for any number of
+ * readers.
+ *
+ * The header holds, in the byte order of the machine that wrote it, the
+ * magic "GDFMMRAW", a uint32 version (1), then int32 frame count, rows,
+ * columns, OpenCV depth type and reference type (-1 without references).
+ * */
+class FrameContainer {
+  public:
+  FrameContainer();
+  ~FrameContainer();
+
+  /** \brief Maps an existing container read-only. Throws
+   * std::runtime_error if it cannot be opened or is not a container. */
+  void Open(const std::string &path);
+
+  /** \brief Creates, or truncates, a container of `frames` frames of
+   * zeros and maps it for writing.
+   *
+   * @param[in] rgbType OpenCV type of the references, or -1 for a
+   * depth-only container
+   * */
+  void Create(const std::string &path,
+              int frames,
+              cv::Size size,
+              int depthType,
+              int rgbType);
+
+  int frames() const { return frames_; }
+  cv::Size size() const { return size_; }
+  int depthType() const { return depthType_; }
+  bool hasReference() const { return rgbType_ >= 0; }
+
+  /** \brief The depth image of frame i, over the mapping; read-only
+   * unless the container was created. */
+  cv::Mat Depth(int i) const;
+  /** \brief The reference image of frame i, see Depth. */
+  cv::Mat Reference(int i) const;
+
+  FrameContainer(const FrameContainer &) = delete;
+  FrameContainer &operator=(const FrameContainer &) = delete;
+
+  private:
+  void Close();
+  // maps `bytes` of the open file
+  void Map(size_t bytes, bool writable);
+  size_t DepthBytes() const;
+  size_t FrameBytes() const;
+  unsigned char *FrameData(int i) const;
+
+  int fd_;
+  unsigned char *data_;
+  size_t bytes_;
+  int frames_;
+  cv::Size size_;
+  int depthType_, rgbType_;
+};
+
+}  // namespace gdfmm
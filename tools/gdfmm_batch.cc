@@ -0,0 +1,474 @@
+/* gdfmm_batch: offline reprocessing of RGB-D datasets.
+ *
+ * Reads frames from a frame container (see frame_container.h) or from a
+ * directory with depth/ and rgb/ images of the same names, fills them
+ * with InPaint or InPaint2, optionally followed by the guided filter,
+ * and writes the results to a container or a directory. Frames are spread
+ * over worker threads that each read, process and write their own frames
+ * with a GDFMM and Workspace of their own.
+ * */
+#include "gdfmm/gdfmm.h"
+#include "frame_container.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace gdfmm;
+
+namespace {
+
+const char kUsage[] =
+"usage: gdfmm_batch [options] <input> <output>\n"
+"\n"
+"  <input>   frame container, or a directory with depth/ and rgb/ images\n"
+"            of the same names\n"
+"  <output>  frame container for the results, or an existing directory\n"
+"            the results are written to as images named like the depths\n"
+"\n"
+"options:\n"
+"  --method inpaint|inpaint2  filling method (inpaint)\n"
+"  --window N                 GDFMM window size (11)\n"
+"  --sigma-distance S         (2)\n"
+"  --sigma-color S            (10)\n"
+"  --blur S                   blur of the speed map (1)\n"
+"  --epsilon E, --constant C, --truncation T\n"
+"                             InPaint2 regression settings (0, 1, 0.05)\n"
+"  --filter N                 guided filter window size, 0 for none (0)\n"
+"  --filter-epsilon E         guided filter regularization (100)\n"
+"  --threads N                worker threads (one per core)\n"
+"  --pack                     only copy the frames, with their references,\n"
+"                             into the output container\n";
+
+struct Options {
+  Options()
+    : inpaint2(false), windowSize(11), sigmaDistance(2), sigmaColor(10),
+      blurSigma(1), epsilon(0), constant(1), truncation(0.05f),
+      filterWindowSize(0), filterEpsilon(100), threads(0), pack(false) {}
+
+  std::string input, output;
+  bool inpaint2;
+  int windowSize;
+  float sigmaDistance, sigmaColor, blurSigma;
+  float epsilon, constant, truncation;
+  int filterWindowSize;
+  float filterEpsilon;
+  int threads;
+  bool pack;
+};
+
+// false on malformed arguments
+bool ParseOptions(int argc, char **argv, Options *options) {
+  std::vector<std::string> positional;
+  for (int i=1; i<argc; i++) {
+    const std::string arg = argv[i];
+    if (arg == "--pack") {
+      options->pack = true;
+      continue;
+    }
+    if (arg.compare(0, 2, "--") != 0) {
+      positional.push_back(arg);
+      continue;
+    }
+    if (i + 1 >= argc) {
+      return false;
+    }
+    const std::string value = argv[++i];
+    try {
+      if (arg == "--method") {
+        if (value != "inpaint" && value != "inpaint2") {
+          return false;
+        }
+        options->inpaint2 = value == "inpaint2";
+      }
+      else if (arg == "--window") options->windowSize = std::stoi(value);
+      else if (arg == "--sigma-distance") options->sigmaDistance = std::stof(value);
+      else if (arg == "--sigma-color") options->sigmaColor = std::stof(value);
+      else if (arg == "--blur") options->blurSigma = std::stof(value);
+      else if (arg == "--epsilon") options->epsilon = std::stof(value);
+      else if (arg == "--constant") options->constant = std::stof(value);
+      else if (arg == "--truncation") options->truncation = std::stof(value);
+      else if (arg == "--filter") options->filterWindowSize = std::stoi(value);
+      else if (arg == "--filter-epsilon") options->filterEpsilon = std::stof(value);
+      else if (arg == "--threads") options->threads = std::stoi(value);
+      else return false;
+    }
+    catch (const std::logic_error &) {
+      return false;
+    }
+  }
+  if (positional.size() != 2 || options->windowSize < 3 ||
+      options->windowSize % 2 == 0 || options->filterWindowSize < 0) {
+    return false;
+  }
+  options->input = positional[0];
+  options->output = positional[1];
+  return true;
+}
+
+bool IsDirectory(const std::string &path) {
+  struct stat status;
+  return stat(path.c_str(), &status) == 0 && S_ISDIR(status.st_mode);
+}
+
+// --- frame sources and sinks ---
+
+// Frames to process; Read may be called concurrently.
+class FrameSource {
+  public:
+  virtual ~FrameSource() {}
+  virtual int frames() const = 0;
+  // `depth` and `rgb` may be left pointing into the source
+  virtual void Read(int i, cv::Mat *depth, cv::Mat *rgb) const = 0;
+};
+
+// Where results go; Buffer and Write may be called concurrently.
+class FrameSink {
+  public:
+  virtual ~FrameSink() {}
+  // the image result i is to be written to, or empty for any
+  virtual cv::Mat Buffer(int i) = 0;
+  // stores result i, if it is not already in Buffer(i)
+  virtual void Write(int i, const cv::Mat &depth, const cv::Mat &rgb) = 0;
+};
+
+class ContainerSource : public FrameSource {
+  public:
+  explicit ContainerSource(const std::string &path) {
+    container_.Open(path);
+    if (!container_.hasReference()) {
+      throw std::runtime_error(path + ": container has no reference images");
+    }
+  }
+  int frames() const { return container_.frames(); }
+  void Read(int i, cv::Mat *depth, cv::Mat *rgb) const {
+    *depth = container_.Depth(i);
+    *rgb = container_.Reference(i);
+  }
+
+  private:
+  FrameContainer container_;
+};
+
+class DirectorySource : public FrameSource {
+  public:
+  explicit DirectorySource(const std::string &path) : path_(path) {
+    DIR *directory = opendir((path + "/depth").c_str());
+    if (!directory) {
+      throw std::runtime_error(path + "/depth: cannot be read");
+    }
+    while (dirent *entry = readdir(directory)) {
+      if (entry->d_name[0] != '.') {
+        names_.push_back(entry->d_name);
+      }
+    }
+    closedir(directory);
+    std::sort(names_.begin(), names_.end());
+  }
+  int frames() const { return static_cast<int>(names_.size()); }
+  void Read(int i, cv::Mat *depth, cv::Mat *rgb) const {
+    *depth = Load(path_ + "/depth/" + names_[i]);
+    *rgb = Load(path_ + "/rgb/" + names_[i]);
+  }
+  const std::string &Name(int i) const { return names_[i]; }
+
+  private:
+  static cv::Mat Load(const std::string &file) {
+    cv::Mat image = cv::imread(file, cv::IMREAD_UNCHANGED);
+    if (image.empty()) {
+      throw std::runtime_error(file + ": cannot be read");
+    }
+    return image;
+  }
+
+  std::string path_;
+  std::vector<std::string> names_;
+};
+
+// Writes into a container created for the frames of a source.
+class ContainerSink : public FrameSink {
+  public:
+  ContainerSink(const std::string &path, int frames, cv::Size size,
+                int depthType, int rgbType) {
+    container_.Create(path, frames, size, depthType, rgbType);
+  }
+  cv::Mat Buffer(int i) { return container_.Depth(i); }
+  void Write(int i, const cv::Mat &depth, const cv::Mat &rgb) {
+    cv::Mat buffer = container_.Depth(i);
+    if (depth.size() != buffer.size() || depth.type() != buffer.type()) {
+      throw std::runtime_error("frame " + std::to_string(i) +
+                               " differs in size or type from frame 0");
+    }
+    if (depth.data != buffer.data) {
+      depth.copyTo(buffer);
+    }
+    if (container_.hasReference()) {
+      cv::Mat reference = container_.Reference(i);
+      if (rgb.size() != reference.size() || rgb.type() != reference.type()) {
+        throw std::runtime_error("frame " + std::to_string(i) +
+                                 " differs in size or type from frame 0");
+      }
+      rgb.copyTo(reference);
+    }
+  }
+
+  private:
+  FrameContainer container_;
+};
+
+// Writes images named by a function of the frame index.
+class DirectorySink : public FrameSink {
+  public:
+  DirectorySink(const std::string &path,
+                std::function<std::string (int)> name)
+    : path_(path), name_(name) {}
+  cv::Mat Buffer(int) { return cv::Mat(); }
+  void Write(int i, const cv::Mat &depth, const cv::Mat &) {
+    const std::string file = path_ + "/" + name_(i);
+    if (!cv::imwrite(file, depth)) {
+      throw std::runtime_error(file + ": cannot be written");
+    }
+  }
+
+  private:
+  std::string path_;
+  std::function<std::string (int)> name_;
+};
+
+// --- processing ---
+
+// wall time of the phases of a worker, in seconds
+struct Timings {
+  Timings() : read(0), process(0), write(0), pixels(0) {}
+  double read, process, write;
+  double pixels;
+};
+
+class Timer {
+  public:
+  explicit Timer(double *seconds)
+    : seconds_(seconds), start_(std::chrono::steady_clock::now()) {}
+  ~Timer() {
+    *seconds_ += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start_).count();
+  }
+
+  private:
+  double *seconds_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Settings and buffers that a worker keeps across its frames.
+class Worker {
+  public:
+  explicit Worker(const Options &options)
+    : options_(options),
+      gdfmm_(options.sigmaDistance, options.sigmaColor, options.blurSigma,
+             options.windowSize) {
+    // results keep the type of the input; the guided filter of InPaint2 runs
+    // on its CV_32F result
+    const bool filter2 = options.inpaint2 && options.filterWindowSize > 0;
+    gdfmm_.SetOutputDepth(filter2 ? CV_32F : -1);
+  }
+
+  /* Fills `depth` into `output`, and returns `rgb` at the size of
+   * `depth`. */
+  const cv::Mat &Process(const cv::Mat &depth, const cv::Mat &rgb,
+                         cv::Mat *output) {
+    const cv::Mat *reference = &rgb;
+    if (rgb.size() != depth.size()) {
+      cv::resize(rgb, resized_, depth.size());
+      reference = &resized_;
+    }
+    if (options_.pack) {
+      *output = depth;
+      return *reference;
+    }
+    const int filterWindowSize = options_.filterWindowSize;
+    if (!options_.inpaint2) {
+      if (filterWindowSize > 0) {
+        gdfmm_.Enhance(depth, *reference, filterWindowSize,
+                       options_.filterEpsilon, output, &workspace_);
+      }
+      else {
+        gdfmm_.InPaint(depth, *reference, output, &workspace_);
+      }
+      return *reference;
+    }
+    if (filterWindowSize == 0) {
+      gdfmm_.InPaint2(depth, *reference, options_.epsilon, options_.constant,
+                      options_.truncation, output, &workspace_);
+      return *reference;
+    }
+    gdfmm_.InPaint2(depth, *reference, options_.epsilon, options_.constant,
+                    options_.truncation, &filled_, &workspace_);
+    GuidedFilterOptions filterOptions;
+    filterOptions.workspace = &workspace_;
+    GuidedFilter(filled_, *reference, &filtered_, filterWindowSize,
+                 options_.filterEpsilon, filterOptions);
+    filtered_.convertTo(*output, depth.depth());
+    return *reference;
+  }
+
+  private:
+  const Options &options_;
+  GDFMM gdfmm_;
+  Workspace workspace_;
+  cv::Mat resized_, filled_, filtered_;
+};
+
+int Run(const Options &options) {
+  std::unique_ptr<FrameSource> source;
+  const DirectorySource *directorySource = nullptr;
+  if (IsDirectory(options.input)) {
+    DirectorySource *directory = new DirectorySource(options.input);
+    source.reset(directory);
+    directorySource = directory;
+  }
+  else {
+    source.reset(new ContainerSource(options.input));
+  }
+  const int frames = source->frames();
+  if (frames == 0) {
+    std::fprintf(stderr, "%s: no frames\n", options.input.c_str());
+    return 1;
+  }
+
+  std::unique_ptr<FrameSink> sink;
+  if (IsDirectory(options.output)) {
+    if (options.pack) {
+      std::fprintf(stderr, "--pack needs an output container\n");
+      return 1;
+    }
+    sink.reset(new DirectorySink(options.output, [&] (int i) {
+      return directorySource ? directorySource->Name(i)
+                             : std::to_string(i) + ".png";
+    }));
+  }
+  else {
+    // the container is laid out after the first frame; references are
+    // stored at the size of the depths
+    cv::Mat depth, rgb;
+    source->Read(0, &depth, &rgb);
+    sink.reset(new ContainerSink(options.output, frames, depth.size(),
+                                 depth.type(),
+                                 options.pack ? rgb.type() : -1));
+  }
+
+  int threads = options.threads > 0
+      ? options.threads
+      : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  threads = std::min(threads, frames);
+  // OpenCV's own workers would only compete with ours
+  cv::setNumThreads(1);
+
+  std::atomic<int> next(0);
+  std::vector<Timings> timings(threads);
+  std::mutex errorMutex;
+  std::string error;
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (int t=0; t<threads; t++) {
+    workers.emplace_back([&, t] {
+      try {
+        Worker worker(options);
+        Timings &timing = timings[t];
+        cv::Mat depth, rgb, result;
+        for (int i; (i = next++) < frames; ) {
+          {
+            Timer timer(&timing.read);
+            source->Read(i, &depth, &rgb);
+          }
+          cv::Mat output = sink->Buffer(i);
+          // without one from the sink, reuse our own buffer
+          const bool ownBuffer = output.empty();
+          if (ownBuffer) {
+            output = result;
+          }
+          const cv::Mat *reference;
+          {
+            Timer timer(&timing.process);
+            reference = &worker.Process(depth, rgb, &output);
+          }
+          {
+            Timer timer(&timing.write);
+            sink->Write(i, output, *reference);
+          }
+          if (ownBuffer) {
+            result = output;
+          }
+          timing.pixels += depth.total();
+        }
+      }
+      catch (const std::exception &e) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        error = e.what();
+        next = frames;
+      }
+      catch (const char *e) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        error = e;
+        next = frames;
+      }
+    });
+  }
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  if (!error.empty()) {
+    std::fprintf(stderr, "gdfmm_batch: %s\n", error.c_str());
+    return 1;
+  }
+
+  const double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  Timings total;
+  for (const Timings &timing : timings) {
+    total.read += timing.read;
+    total.process += timing.process;
+    total.write += timing.write;
+    total.pixels += timing.pixels;
+  }
+  const double megapixels = total.pixels / 1e6;
+  const double busy = std::max(total.read + total.process + total.write, 1e-9);
+  std::printf("%d frames in %.2f s with %d workers: %.1f frames/s, %.1f MP/s\n",
+              frames, seconds, threads, frames / seconds, megapixels / seconds);
+  std::printf("worker time: read %.0f%%, process %.0f%%, write %.0f%%\n",
+              100 * total.read / busy, 100 * total.process / busy,
+              100 * total.write / busy);
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) {
+    std::fputs(kUsage, stderr);
+    return 2;
+  }
+  try {
+    return Run(options);
+  }
+  catch (const std::exception &e) {
+    std::fprintf(stderr, "gdfmm_batch: %s\n", e.what());
+    return 1;
+  }
+}